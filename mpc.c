@@ -69,6 +69,23 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_EVENTS_MIN = 64
+};
+
+enum {
+  MPC_EVENT_ENTER = 0,
+  MPC_EVENT_TOKEN = 1,
+  MPC_EVENT_LEAVE = 2
+};
+
+typedef struct {
+  int type;
+  const char *tag;
+  char *contents;
+  mpc_state_t state;
+} mpc_event_t;
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
@@ -92,6 +109,14 @@ typedef struct {
   char *lasts;
   char last;
   
+  const mpc_events_t *events;
+  void *events_data;
+  int events_soft;
+  int events_base;
+  int events_num;
+  int events_slots;
+  mpc_event_t *events_log;
+  
   size_t mem_index;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
@@ -121,6 +146,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->events = NULL;
+  i->events_data = NULL;
+  i->events_soft = 0;
+  i->events_base = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_log = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -151,6 +184,14 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->events = NULL;
+  i->events_data = NULL;
+  i->events_soft = 0;
+  i->events_base = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_log = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -180,6 +221,14 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->events = NULL;
+  i->events_data = NULL;
+  i->events_soft = 0;
+  i->events_base = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_log = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -208,6 +257,14 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
+  i->events = NULL;
+  i->events_data = NULL;
+  i->events_soft = 0;
+  i->events_base = 0;
+  i->events_num = 0;
+  i->events_slots = 0;
+  i->events_log = NULL;
+  
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
   
@@ -223,6 +280,7 @@ static void mpc_input_delete(mpc_input_t *i) {
   
   free(i->marks);
   free(i->lasts);
+  free(i->events_log);
   free(i);
 }
 
@@ -362,7 +420,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->string[i->state.pos] == '\0') { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -506,6 +564,12 @@ static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+static int mpc_input_charset(mpc_input_t *i, const unsigned char *c, char **o) {
+  char x = mpc_input_getc(i);
+  if (mpc_input_terminated(i)) { return 0; }
+  return (c[(unsigned char)x >> 3] >> ((unsigned char)x & 7)) & 1 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+}
+
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
@@ -720,6 +784,14 @@ static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   strcpy(x->expected[x->expected_num-1], expected);
 }
 
+/* Expected message of an alternative that was not run, merged as `or` would */
+static mpc_err_t *mpc_err_add_missed(mpc_input_t *i, mpc_err_t *x, const char *m) {
+  if (m == NULL || i->suppress) { return x; }
+  if (x == NULL) { return mpc_err_new(i, m); }
+  if (!mpc_err_contains_expected(i, x, (char*)m)) { mpc_err_add_expected(i, x, (char*)m); }
+  return x;
+}
+
 static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
   
   int j, k, fst;
@@ -885,9 +957,27 @@ enum {
   MPC_TYPE_AND        = 24,
 
   MPC_TYPE_CHECK      = 25,
-  MPC_TYPE_CHECK_WITH = 26
+  MPC_TYPE_CHECK_WITH = 26,
+
+  MPC_TYPE_CHARSET    = 27
 };
 
+typedef struct {
+  char c;
+  int child;
+  int sibling;
+  int alt;
+} mpc_trie_node_t;
+
+typedef struct {
+  int alts_num;
+  int nodes_num;
+  mpc_trie_node_t *nodes;
+  int *next;
+  char *lead;
+  char **ms;
+} mpc_trie_t;
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
@@ -903,8 +993,9 @@ typedef struct { mpc_parser_t *x; mpc_check_with_t f; void *d; char *e; } mpc_pd
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; mpc_trie_t *trie; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { unsigned char *x; int n; char **ms; } mpc_pdata_charset_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -924,6 +1015,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_charset_t charset;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -933,6 +1025,94 @@ struct mpc_parser_t {
   char retained;
 };
 
+/*
+** Events
+**
+** `mpc_parse_events` runs a grammar built with
+** `mpca_lang` or the `mpca_` functions without
+** building the AST. Where a node would be made a
+** small event is added to a log instead, and the
+** value passed up is the log position its events
+** start from. Freeing a value drops the events
+** after it, just as freeing the node would.
+**
+** Events are sent on once nothing can drop them.
+** That is whenever no `maybe`, `many`, `not` or
+** `or` alternative other than the last is waiting
+** on a parser which might fail, as any other
+** failure fails the whole parse. Like most event
+** parsers the callbacks can see the start of an
+** input which later turns out to be invalid. For
+** a grammar of repeated top level forms only the
+** events of the current form are kept.
+*/
+
+static mpc_val_t *mpc_events_add(mpc_input_t *i, int type, const char *tag, char *contents) {
+  
+  mpc_event_t *v;
+  
+  if (i->events_num == i->events_slots) {
+    i->events_slots = i->events_slots ? i->events_slots * 2 : MPC_INPUT_EVENTS_MIN;
+    i->events_log = realloc(i->events_log, sizeof(mpc_event_t) * i->events_slots);
+  }
+  
+  v = &i->events_log[i->events_num++];
+  v->type = type;
+  v->tag = tag;
+  v->contents = contents;
+  v->state = i->state;
+  
+  /* Offset by one so that a value with no events is still NULL */
+  return (mpc_val_t*)(size_t)(i->events_base + i->events_num);
+}
+
+static mpc_event_t *mpc_events_get(mpc_input_t *i, mpc_val_t *x) {
+  int j = (int)(size_t)x - 1 - i->events_base;
+  return x && j >= 0 && j < i->events_num ? &i->events_log[j] : NULL;
+}
+
+static void mpc_events_drop(mpc_input_t *i, mpc_val_t *x) {
+  int j = (int)(size_t)x - 1 - i->events_base;
+  if (x == NULL) { return; }
+  if (j < 0) { j = 0; }
+  while (i->events_num > j) {
+    mpc_free(i, i->events_log[--i->events_num].contents);
+  }
+}
+
+static void mpc_events_flush(mpc_input_t *i) {
+  
+  int j;
+  mpc_event_t *v;
+  const mpc_events_t *ev = i->events;
+  
+  for (j = 0; j < i->events_num; j++) {
+    v = &i->events_log[j];
+    switch (v->type) {
+      case MPC_EVENT_ENTER:
+        if (ev->enter) { ev->enter(i->events_data, v->tag, v->state); }
+        break;
+      case MPC_EVENT_TOKEN:
+        if (ev->token) { ev->token(i->events_data, v->tag, v->contents, v->state); }
+        mpc_free(i, v->contents);
+        break;
+      case MPC_EVENT_LEAVE:
+        if (ev->leave) { ev->leave(i->events_data, v->tag); }
+        break;
+    }
+  }
+  
+  i->events_base += i->events_num;
+  i->events_num = 0;
+}
+
+/* Called around children whose failure does not fail their parent */
+static void mpc_events_soft(mpc_input_t *i, int d) {
+  if (i->events == NULL) { return; }
+  i->events_soft += d;
+  if (i->events_soft == 0) { mpc_events_flush(i); }
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -962,8 +1142,22 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+static mpc_val_t *mpc_events_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
+  int j;
+  mpc_event_t *v;
+  if (f == mpcf_state_ast) {
+    v = mpc_events_get(i, xs[1]);
+    if (v && v->type == MPC_EVENT_TOKEN) { v->state = *(mpc_state_t*)xs[0]; }
+    mpc_free(i, xs[0]);
+    return xs[1];
+  }
+  for (j = 0; j < n; j++) { if (xs[j]) { return xs[j]; } }
+  return NULL;
+}
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
+  if (i->events && (f == mpcf_fold_ast || f == mpcf_state_ast)) { return mpc_events_fold(i, f, n, xs); }
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
   if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
   if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
@@ -989,20 +1183,211 @@ static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
 }
 
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (i->events && f == mpcf_str_ast) { return mpc_events_add(i, MPC_EVENT_TOKEN, "", x); }
+  if (i->events && f == (mpc_apply_t)mpc_ast_add_root) { return x; }
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
   return f(mpc_export(i, x));
 }
 
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  mpc_event_t *v;
+  if (i->events && f == (mpc_apply_to_t)mpc_ast_tag) {
+    v = mpc_events_get(i, x);
+    if (v && v->type == MPC_EVENT_TOKEN) { v->tag = d; }
+    return x;
+  }
   return f(mpc_export(i, x), d);
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (i->events && d == (mpc_dtor_t)mpc_ast_delete) { mpc_events_drop(i, x); return; }
   if (d == free) { mpc_free(i, x); return; }
   d(mpc_export(i, x));
 }
 
+/*
+** Literal Index
+*/
+
+/*
+** An `or` where several alternatives start with a
+** literal string or character, such as a list of
+** keywords or operators, gets a trie of those
+** literals from `mpc_optimise`. Parsing walks the
+** trie once to find which literals are at the
+** input and only runs those alternatives (and any
+** that do not start with a literal) in order.
+** Alternatives whose literal is not there would
+** have failed straight away, so their expected
+** messages are added to the error without running
+** them. The result and errors are the same as
+** trying every alternative.
+**
+** Each trie node keeps the first alternative whose
+** literal ends there and `next` chains together
+** alternatives with the same literal.
+**
+** Without backtracking the input cannot be looked
+** ahead of, and a literal that fails part way
+** leaves the input moved on for the alternatives
+** after it. So instead each literal's first
+** character (kept in `lead`) is checked against
+** the input just before it would have been run.
+*/
+
+enum {
+  MPC_TRIE_MIN = 4
+};
+
+static void mpc_trie_delete(mpc_trie_t *t) {
+  int j;
+  if (t == NULL) { return; }
+  for (j = 0; j < t->alts_num; j++) { free(t->ms[j]); }
+  free(t->nodes);
+  free(t->next);
+  free(t->lead);
+  free(t->ms);
+  free(t);
+}
+
+/* The literal an alternative must start with and the message it fails with */
+static const char *mpc_trie_literal(mpc_parser_t *p, const char **m, char *c) {
+  
+  int j;
+  
+  while (!p->retained) {
+    switch (p->type) {
+      
+      case MPC_TYPE_EXPECT:
+        if (*m == NULL) { *m = p->data.expect.m; }
+        p = p->data.expect.x;
+        break;
+      
+      case MPC_TYPE_APPLY:    p = p->data.apply.x;    break;
+      case MPC_TYPE_APPLY_TO: p = p->data.apply_to.x; break;
+      
+      case MPC_TYPE_AND:
+        for (j = 0; j < p->data.and.n-1; j++) {
+          mpc_parser_t *q = p->data.and.xs[j];
+          if (q->retained) { return NULL; }
+          if (q->type != MPC_TYPE_STATE && q->type != MPC_TYPE_LIFT
+          &&  q->type != MPC_TYPE_LIFT_VAL && q->type != MPC_TYPE_PASS) { break; }
+        }
+        p = p->data.and.xs[j];
+        break;
+      
+      case MPC_TYPE_SINGLE:
+        if (p->data.single.x == '\0') { return NULL; }
+        c[0] = p->data.single.x;
+        c[1] = '\0';
+        return c;
+      
+      case MPC_TYPE_STRING:
+        return p->data.string.x[0] == '\0' ? NULL : p->data.string.x;
+      
+      default: return NULL;
+    }
+  }
+  
+  return NULL;
+}
+
+static mpc_trie_t *mpc_trie_new(mpc_parser_t *p) {
+  
+  int j, k, node, count;
+  const char *s, *m;
+  char c[2];
+  mpc_trie_t *t;
+  int n = p->data.or.n;
+  
+  count = 0;
+  for (j = 0; j < n; j++) {
+    m = NULL;
+    if (mpc_trie_literal(p->data.or.xs[j], &m, c)) { count++; }
+  }
+  if (count < MPC_TRIE_MIN) { return NULL; }
+  
+  t = malloc(sizeof(mpc_trie_t));
+  t->alts_num = n;
+  t->nodes_num = 1;
+  t->nodes = malloc(sizeof(mpc_trie_node_t));
+  t->nodes[0].c = '\0';
+  t->nodes[0].child = -1;
+  t->nodes[0].sibling = -1;
+  t->nodes[0].alt = -1;
+  t->next = malloc(sizeof(int) * n);
+  t->lead = calloc(n, 1);
+  t->ms = calloc(n, sizeof(char*));
+  
+  for (j = 0; j < n; j++) {
+    
+    t->next[j] = -1;
+    m = NULL;
+    s = mpc_trie_literal(p->data.or.xs[j], &m, c);
+    if (s == NULL) { continue; }
+    
+    t->lead[j] = s[0];
+    if (m) {
+      t->ms[j] = malloc(strlen(m) + 1);
+      strcpy(t->ms[j], m);
+    }
+    
+    for (node = 0; *s; s++) {
+      for (k = t->nodes[node].child; k != -1; k = t->nodes[k].sibling) {
+        if (t->nodes[k].c == *s) { break; }
+      }
+      if (k == -1) {
+        k = t->nodes_num++;
+        t->nodes = realloc(t->nodes, sizeof(mpc_trie_node_t) * t->nodes_num);
+        t->nodes[k].c = *s;
+        t->nodes[k].child = -1;
+        t->nodes[k].sibling = t->nodes[node].child;
+        t->nodes[k].alt = -1;
+        t->nodes[node].child = k;
+      }
+      node = k;
+    }
+    
+    if (t->nodes[node].alt == -1) {
+      t->nodes[node].alt = j;
+    } else {
+      for (k = t->nodes[node].alt; t->next[k] != -1; k = t->next[k]);
+      t->next[k] = j;
+    }
+  }
+  
+  return t;
+}
+
+/* Marks the alternatives whose literal is at the input, without consuming it */
+static char *mpc_trie_match(mpc_input_t *i, mpc_trie_t *t, int n) {
+  
+  int k, node = 0;
+  char x;
+  char *matched = mpc_calloc(i, n, 1);
+  
+  mpc_input_mark(i);
+  while (t->nodes[node].child != -1) {
+    x = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    for (k = t->nodes[node].child; k != -1; k = t->nodes[k].sibling) {
+      if (t->nodes[k].c == x) { break; }
+    }
+    if (k == -1) { mpc_input_failure(i, x); break; }
+    mpc_input_success(i, x, NULL);
+    node = k;
+    for (k = t->nodes[node].alt; k != -1; k = t->next[k]) { matched[k] = 1; }
+  }
+  mpc_input_rewind(i);
+  
+  return matched;
+}
+
+/*
+** Parsing
+*/
+
 enum {
   MPC_PARSE_STACK_MIN = 4
 };
@@ -1013,6 +1398,9 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
+static int mpc_parse_trie(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+static int mpc_parse_rule_events(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
   int j = 0, k = 0;
@@ -1033,6 +1421,15 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
     case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
     
+    case MPC_TYPE_CHARSET:
+      if (mpc_input_charset(i, p->data.charset.x, (char**)&r->output)) { MPC_SUCCESS(r->output); }
+      r->error = NULL;
+      for (j = 0; j < p->data.charset.n; j++) {
+        r->error = mpc_err_add_missed(i, r->error, p->data.charset.ms[j]);
+      }
+      if (r->error) { *e = mpc_err_merge(i, *e, r->error); }
+      MPC_FAILURE(NULL);
+    
     /* Other parsers */
     
     case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
@@ -1052,6 +1449,9 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
     
     case MPC_TYPE_APPLY_TO:
+      if (i->events && p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        return mpc_parse_rule_events(i, p, r, e);
+      }
       if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
       } else {
@@ -1107,21 +1507,27 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_NOT:
       mpc_input_mark(i);
       mpc_input_suppress_enable(i);
+      mpc_events_soft(i, 1);
       if (mpc_parse_run(i, p->data.not.x, r, e)) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
         mpc_parse_dtor(i, p->data.not.dx, r->output);
+        mpc_events_soft(i, -1);
         MPC_FAILURE(mpc_err_new(i, "opposite"));
       } else {
         mpc_input_unmark(i);
         mpc_input_suppress_disable(i);
+        mpc_events_soft(i, -1);
         MPC_SUCCESS(p->data.not.lf());
       }
     
     case MPC_TYPE_MAYBE:
+      mpc_events_soft(i, 1);
       if (mpc_parse_run(i, p->data.not.x, r, e)) {
+        mpc_events_soft(i, -1);
         MPC_SUCCESS(r->output);
       } else {
+        mpc_events_soft(i, -1);
         *e = mpc_err_merge(i, *e, r->error);
         MPC_SUCCESS(p->data.not.lf());
       }
@@ -1132,7 +1538,10 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       results = results_stk;
       
+      mpc_events_soft(i, 1);
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+        mpc_events_soft(i, -1);
+        mpc_events_soft(i, 1);
         j++;
         if (j == MPC_PARSE_STACK_MIN) {
           results_slots = j + j / 2;
@@ -1143,6 +1552,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
           results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
         }
       }
+      mpc_events_soft(i, -1);
       
       *e = mpc_err_merge(i, *e, results[j].error);
       MPC_SUCCESS(
@@ -1153,7 +1563,10 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       results = results_stk;
       
+      /* Only the first repeat failing fails the parser */
       while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+        if (j > 0) { mpc_events_soft(i, -1); }
+        mpc_events_soft(i, 1);
         j++;
         if (j == MPC_PARSE_STACK_MIN) {
           results_slots = j + j / 2;
@@ -1164,6 +1577,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
           results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
         }
       }
+      if (j > 0) { mpc_events_soft(i, -1); }
       
       if (j == 0) {
         MPC_FAILURE(
@@ -1206,12 +1620,17 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       
       if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
       
+      if (p->data.or.trie) { return mpc_parse_trie(i, p, r, e); }
+      
       results = p->data.or.n > MPC_PARSE_STACK_MIN
         ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
         : results_stk;
       
       for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
+        if (j < p->data.or.n-1) { mpc_events_soft(i, 1); }
+        k = mpc_parse_run(i, p->data.or.xs[j], &results[j], e);
+        if (j < p->data.or.n-1) { mpc_events_soft(i, -1); }
+        if (k) {
           MPC_SUCCESS(results[j].output;
             if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
         } else {
@@ -1257,6 +1676,68 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
   
 }
 
+/*
+** Same as the `or` case but only running the
+** alternatives the trie says can match.
+*/
+
+static int mpc_parse_trie(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int j, k;
+  mpc_result_t x;
+  mpc_err_t *missed = NULL;
+  mpc_trie_t *t = p->data.or.trie;
+  char *matched = i->backtrack > 0 ? mpc_trie_match(i, t, p->data.or.n) : NULL;
+  
+  for (j = 0; j < p->data.or.n; j++) {
+    
+    if (t->lead[j] && (matched ? !matched[j] : t->lead[j] != mpc_input_peekc(i))) {
+      missed = mpc_err_add_missed(i, missed, t->ms[j]);
+      continue;
+    }
+    
+    if (missed) {
+      *e = mpc_err_merge(i, *e, missed);
+      missed = NULL;
+    }
+    
+    if (j < p->data.or.n-1) { mpc_events_soft(i, 1); }
+    k = mpc_parse_run(i, p->data.or.xs[j], &x, e);
+    if (j < p->data.or.n-1) { mpc_events_soft(i, -1); }
+    
+    if (k) {
+      mpc_free(i, matched);
+      MPC_SUCCESS(x.output);
+    } else {
+      *e = mpc_err_merge(i, *e, x.error);
+    }
+  }
+  
+  if (missed) { *e = mpc_err_merge(i, *e, missed); }
+  mpc_free(i, matched);
+  MPC_FAILURE(NULL);
+}
+
+/*
+** A rule tagged by `mpca_lang` when parsing with
+** events. The enter event is logged before the
+** rule runs so it comes before the events of the
+** rule, and is dropped again if the rule fails.
+*/
+
+static int mpc_parse_rule_events(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  mpc_val_t *x = mpc_events_add(i, MPC_EVENT_ENTER, p->data.apply_to.d, NULL);
+  
+  if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
+    mpc_events_add(i, MPC_EVENT_LEAVE, p->data.apply_to.d, NULL);
+    MPC_SUCCESS(x);
+  } else {
+    mpc_events_drop(i, x);
+    MPC_FAILURE(r->error);
+  }
+}
+
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
 #undef MPC_PRIMITIVE
@@ -1307,6 +1788,43 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
+static int mpc_parse_input_events(mpc_input_t *i, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r) {
+  int x;
+  i->events = ev;
+  i->events_data = d;
+  x = mpc_parse_input(i, p, r);
+  if (x) {
+    mpc_events_flush(i);
+    r->output = NULL;
+  }
+  mpc_events_drop(i, (mpc_val_t*)(size_t)(i->events_base + 1));
+  return x;
+}
+
+int mpc_parse_events(const char *filename, const char *string, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input_events(i, p, ev, d, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_events_file(const char *filename, FILE *file, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input_events(i, p, ev, d, r);
+  mpc_input_delete(i);
+  return x;
+}
+
+int mpc_parse_events_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input_events(i, p, ev, d, r);
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
   FILE *f = fopen(filename, "rb");
@@ -1336,6 +1854,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  mpc_trie_delete(p->data.or.trie);
   
 }
 
@@ -1350,6 +1869,17 @@ static void mpc_undefine_and(mpc_parser_t *p) {
   
 }
 
+static void mpc_undefine_charset(mpc_parser_t *p) {
+  
+  int i;
+  for (i = 0; i < p->data.charset.n; i++) {
+    free(p->data.charset.ms[i]);
+  }
+  free(p->data.charset.ms);
+  free(p->data.charset.x);
+  
+}
+
 static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
   if (p->retained && !force) { return; }
@@ -1387,6 +1917,8 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_CHARSET: mpc_undefine_charset(p); break;
+    
     case MPC_TYPE_CHECK:
       mpc_undefine_unretained(p->data.check.x, 0);
       free(p->data.check.e);
@@ -1498,6 +2030,7 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      p->data.or.trie = a->data.or.trie ? mpc_trie_new(p) : NULL;
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1520,6 +2053,16 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       p->data.check_with.e = malloc(strlen(a->data.check_with.e)+1);
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
+    
+    case MPC_TYPE_CHARSET:
+      p->data.charset.x = malloc(32);
+      memcpy(p->data.charset.x, a->data.charset.x, 32);
+      p->data.charset.ms = malloc(a->data.charset.n * sizeof(char*));
+      for (i = 0; i < a->data.charset.n; i++) {
+        p->data.charset.ms[i] = malloc(strlen(a->data.charset.ms[i])+1);
+        strcpy(p->data.charset.ms[i], a->data.charset.ms[i]);
+      }
+      break;
 
     default: break;
   }
@@ -2263,11 +2806,47 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+/*
+** The regex grammar is built on first use and kept
+** for the life of the program. Compiled regexes are
+** cached by their source string, so each distinct
+** pattern is only compiled once and `mpc_re` hands
+** out copies of the cached parser.
+**
+** The lock guards the grammar and the cache but not
+** the compile itself, as parsing with a finished
+** grammar does not modify it.
+*/
+
+enum {
+  MPC_RE_CACHE_SLOTS = 1024
+};
+
+typedef struct {
+  char *re;
+  mpc_parser_t *p;
+} mpc_re_entry_t;
+
+static mpc_parser_t *mpc_re_grammar = NULL;
+static mpc_re_entry_t mpc_re_cache[MPC_RE_CACHE_SLOTS];
+static int mpc_re_cache_num = 0;
+
+#if defined(__GNUC__)
+static volatile int mpc_re_locked = 0;
+static void mpc_re_lock(void) { while (__sync_lock_test_and_set(&mpc_re_locked, 1)) { } }
+static void mpc_re_unlock(void) { __sync_lock_release(&mpc_re_locked); }
+#elif defined(_MSC_VER)
+#include <intrin.h>
+static volatile long mpc_re_locked = 0;
+static void mpc_re_lock(void) { while (_InterlockedExchange(&mpc_re_locked, 1)) { } }
+static void mpc_re_unlock(void) { _InterlockedExchange(&mpc_re_locked, 0); }
+#else
+static void mpc_re_lock(void) { }
+static void mpc_re_unlock(void) { }
+#endif
+
+static mpc_parser_t *mpc_re_grammar_new(void) {
   
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
   
   Regex  = mpc_new("regex");
@@ -2314,20 +2893,67 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_optimise(Base);
   mpc_optimise(Range);
   
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+  return RegexEnclose;
+}
+
+static mpc_re_entry_t *mpc_re_cache_slot(const char *re) {
+  unsigned long h = 5381;
+  const char *c;
+  for (c = re; *c; c++) { h = h * 33 + (unsigned char)*c; }
+  h &= MPC_RE_CACHE_SLOTS - 1;
+  while (mpc_re_cache[h].re && strcmp(mpc_re_cache[h].re, re) != 0) {
+    h = (h + 1) & (MPC_RE_CACHE_SLOTS - 1);
+  }
+  return &mpc_re_cache[h];
+}
+
+static mpc_parser_t *mpc_re_compile(mpc_parser_t *grammar, const char *re) {
+  
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  
+  if(!mpc_parse("<mpc_re_compiler>", re, grammar, &r)) {
     err_msg = mpc_err_string(r.error);
     err_out = mpc_failf("Invalid Regex: %s", err_msg);
-    mpc_err_delete(r.error);  
+    mpc_err_delete(r.error);
     free(err_msg);
     r.output = err_out;
   }
   
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
-  
   mpc_optimise(r.output);
   
   return r.output;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
   
+  mpc_parser_t *grammar, *p;
+  mpc_re_entry_t *e;
+  
+  mpc_re_lock();
+  if (mpc_re_grammar == NULL) { mpc_re_grammar = mpc_re_grammar_new(); }
+  grammar = mpc_re_grammar;
+  p = mpc_re_cache_slot(re)->p;
+  mpc_re_unlock();
+  
+  /* Cached parsers are never changed or freed so can be copied unlocked */
+  if (p) { return mpc_copy(p); }
+  
+  p = mpc_re_compile(grammar, re);
+  
+  mpc_re_lock();
+  e = mpc_re_cache_slot(re);
+  if (e->re == NULL && mpc_re_cache_num < MPC_RE_CACHE_SLOTS / 2) {
+    e->re = malloc(strlen(re) + 1);
+    strcpy(e->re, re);
+    e->p = p;
+    mpc_re_cache_num++;
+    p = NULL;
+  }
+  mpc_re_unlock();
+  
+  return p ? p : mpc_copy(e->p);
 }
 
 /*
@@ -2587,6 +3213,23 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
 ** Printing
 */
 
+/* Lists the members of a set, or the rest if it holds most characters */
+static char *mpc_print_charset(const unsigned char *x, int *none) {
+  
+  int j, k = 0;
+  char *s = malloc(257);
+  
+  for (j = 1; j < 256; j++) { k += (x[j >> 3] >> (j & 7)) & 1; }
+  *none = k > 127;
+  
+  for (j = 1, k = 0; j < 256; j++) {
+    if (((x[j >> 3] >> (j & 7)) & 1) != *none) { s[k++] = (char)j; }
+  }
+  s[k] = '\0';
+  
+  return s;
+}
+
 static void mpc_print_unretained(mpc_parser_t *p, int force) {
   
   /* TODO: Print Everything Escaped */
@@ -2659,6 +3302,17 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(s);
   }
   
+  if (p->type == MPC_TYPE_CHARSET) {
+    e = mpc_print_charset(p->data.charset.x, &i);
+    s = mpcf_escape_new(
+      e,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf(i ? "[^%s]" : "[%s]", s);
+    free(s);
+    free(e);
+  }
+  
   if (p->type == MPC_TYPE_STRING) {
     s = mpcf_escape_new(
       p->data.string.x,
@@ -3111,10 +3765,117 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+/*
+** Array Walk
+**
+** Pre and post order keep a stack of frames, one per
+** level of the tree, each holding the index of the
+** next child to visit. A child of -1 means the node
+** itself has not been visited yet.
+**
+** Level order keeps a queue of parents instead, from
+** `head` to `frames_num`, and hands out their children
+** one at a time. Only nodes with children are queued.
+*/
+
+enum {
+  MPC_AST_WALK_MIN = 32
+};
+
+static void mpc_ast_walk_push(mpc_ast_walk_t *w, mpc_ast_t *a, int child) {
   
-  int i, j;
-  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_walk_frame_t *frames;
+  
+  /* Reuse the space already consumed from the front of the queue */
+  if (w->frames_num == w->frames_slots && w->head > 0 && w->head * 2 >= w->frames_num) {
+    memmove(w->frames, w->frames + w->head,
+      sizeof(mpc_ast_walk_frame_t) * (w->frames_num - w->head));
+    w->frames_num -= w->head;
+    w->head = 0;
+  }
+  
+  if (w->frames_num == w->frames_slots) {
+    w->frames_slots = w->frames_slots ? w->frames_slots * 2 : MPC_AST_WALK_MIN;
+    if (w->owned) {
+      w->frames = realloc(w->frames, sizeof(mpc_ast_walk_frame_t) * w->frames_slots);
+    } else {
+      frames = malloc(sizeof(mpc_ast_walk_frame_t) * w->frames_slots);
+      if (w->frames_num) {
+        memcpy(frames, w->frames, sizeof(mpc_ast_walk_frame_t) * w->frames_num);
+      }
+      w->frames = frames;
+      w->owned = 1;
+    }
+  }
+  
+  w->frames[w->frames_num].node = a;
+  w->frames[w->frames_num].child = child;
+  w->frames_num++;
+}
+
+void mpc_ast_walk_start(mpc_ast_walk_t *w, mpc_ast_t *ast,
+                        mpc_ast_walk_order_t order,
+                        mpc_ast_walk_frame_t *buf, int buf_num) {
+  w->order = order;
+  w->frames = buf;
+  w->head = 0;
+  w->frames_num = 0;
+  w->frames_slots = buf ? buf_num : 0;
+  w->owned = 0;
+  if (ast) { mpc_ast_walk_push(w, ast, -1); }
+}
+
+mpc_ast_t *mpc_ast_walk_next(mpc_ast_walk_t *w) {
+  
+  mpc_ast_walk_frame_t *f;
+  mpc_ast_t *a;
+  
+  if (w->order == mpc_ast_walk_order_level) {
+    
+    while (w->head < w->frames_num) {
+      f = &w->frames[w->head];
+      if (f->child < 0) { f->child = 0; return f->node; }
+      if (f->child < f->node->children_num) {
+        a = f->node->children[f->child++];
+        if (a->children_num > 0) { mpc_ast_walk_push(w, a, 0); }
+        return a;
+      }
+      w->head++;
+    }
+    
+    return NULL;
+  }
+  
+  while (w->frames_num > 0) {
+    f = &w->frames[w->frames_num-1];
+    if (f->child < 0) {
+      f->child = 0;
+      if (w->order == mpc_ast_walk_order_pre) { return f->node; }
+    }
+    if (f->child < f->node->children_num) {
+      mpc_ast_walk_push(w, f->node->children[f->child++], -1);
+      continue;
+    }
+    w->frames_num--;
+    if (w->order == mpc_ast_walk_order_post) { return f->node; }
+  }
+  
+  return NULL;
+}
+
+void mpc_ast_walk_free(mpc_ast_walk_t *w) {
+  if (w->owned) { free(w->frames); }
+  w->frames = NULL;
+  w->head = 0;
+  w->frames_num = 0;
+  w->frames_slots = 0;
+  w->owned = 0;
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+  
+  int i, j;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
   
   if (n == 0) { return NULL; }
@@ -3281,7 +4042,11 @@ mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_
 typedef struct {
   va_list *va;
   int parsers_num;
+  int parsers_slots;
   mpc_parser_t **parsers;
+  int names_num;
+  int names_slots;
+  int *names;
   int flags;
 } mpca_grammar_st_t;
 
@@ -3348,6 +4113,71 @@ static int is_number(const char* s) {
   return 1;
 }
 
+/*
+** Parsers taken from the arguments are kept in
+** order, and those with names are also put into
+** an open addressed table of indices, so that
+** looking up a rule by name takes constant time
+** and building a grammar is linear in its size.
+*/
+
+static unsigned long mpca_grammar_hash(const char *x) {
+  unsigned long h = 5381;
+  while (*x) { h = h * 33 + (unsigned char)*x++; }
+  return h;
+}
+
+static mpc_parser_t *mpca_grammar_lookup(mpca_grammar_st_t *st, const char *x) {
+  
+  unsigned long h;
+  mpc_parser_t *q;
+  
+  if (st->names_slots == 0) { return NULL; }
+  
+  h = mpca_grammar_hash(x) & (st->names_slots-1);
+  while (st->names[h]) {
+    q = st->parsers[st->names[h]-1];
+    if (strcmp(q->name, x) == 0) { return q; }
+    h = (h+1) & (st->names_slots-1);
+  }
+  
+  return NULL;
+}
+
+static void mpca_grammar_index(mpca_grammar_st_t *st, int i) {
+  unsigned long h = mpca_grammar_hash(st->parsers[i]->name) & (st->names_slots-1);
+  while (st->names[h]) { h = (h+1) & (st->names_slots-1); }
+  st->names[h] = i+1;
+}
+
+static void mpca_grammar_add_parser(mpca_grammar_st_t *st, mpc_parser_t *p) {
+  
+  int i;
+  
+  if (st->parsers_num == st->parsers_slots) {
+    st->parsers_slots = st->parsers_slots ? st->parsers_slots * 2 : 16;
+    st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_slots);
+  }
+  st->parsers[st->parsers_num++] = p;
+  
+  if (p == NULL || p->name == NULL || mpca_grammar_lookup(st, p->name)) { return; }
+  
+  if ((st->names_num+1) * 2 > st->names_slots) {
+    free(st->names);
+    st->names_slots = st->names_slots ? st->names_slots * 2 : 32;
+    st->names = calloc(st->names_slots, sizeof(int));
+    for (i = 0; i < st->parsers_num-1; i++) {
+      if (st->parsers[i] && st->parsers[i]->name
+      &&  mpca_grammar_lookup(st, st->parsers[i]->name) == NULL) {
+        mpca_grammar_index(st, i);
+      }
+    }
+  }
+  
+  mpca_grammar_index(st, st->parsers_num-1);
+  st->names_num++;
+}
+
 static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
   
   int i;
@@ -3359,37 +4189,40 @@ static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
     i = strtol(x, NULL, 10);
     
     while (st->parsers_num <= i) {
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
+      if (st->parsers_num > 0 && st->parsers[st->parsers_num-1] == NULL) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+      }
+      mpca_grammar_add_parser(st, va_arg(*st->va, mpc_parser_t*));
       if (st->parsers[st->parsers_num-1] == NULL) {
         return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
       }
     }
     
-    return st->parsers[st->parsers_num-1];
+    if (st->parsers[i] == NULL) {
+      return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+    }
+    
+    return st->parsers[i];
   
   /* Case of Identifier */
   } else {
     
     /* Search Existing Parsers */
-    for (i = 0; i < st->parsers_num; i++) {
-      mpc_parser_t *q = st->parsers[i];
-      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (q->name && strcmp(q->name, x) == 0) { return q; }
+    p = mpca_grammar_lookup(st, x);
+    if (p) { return p; }
+    
+    if (st->parsers_num > 0 && st->parsers[st->parsers_num-1] == NULL) {
+      return mpc_failf("Unknown Parser '%s'!", x);
     }
     
     /* Search New Parsers */
     while (1) {
     
       p = va_arg(*st->va, mpc_parser_t*);
-      
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = p;
+      mpca_grammar_add_parser(st, p);
       
       if (p == NULL || p->name == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (p->name && strcmp(p->name, x) == 0) { return p; }
+      if (strcmp(p->name, x) == 0) { return p; }
       
     }
   
@@ -3485,11 +4318,16 @@ mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
   
   st.va = &va;
   st.parsers_num = 0;
+  st.parsers_slots = 0;
   st.parsers = NULL;
+  st.names_num = 0;
+  st.names_slots = 0;
+  st.names = NULL;
   st.flags = flags;
   
   res = mpca_grammar_st(grammar, &st);  
   free(st.parsers);
+  free(st.names);
   va_end(va);
   return res;
 }
@@ -3645,7 +4483,11 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
   
   st.va = &va;
   st.parsers_num = 0;
+  st.parsers_slots = 0;
   st.parsers = NULL;
+  st.names_num = 0;
+  st.names_slots = 0;
+  st.names = NULL;
   st.flags = flags;
   
   i = mpc_input_new_file("<mpca_lang_file>", f);
@@ -3653,6 +4495,7 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
   mpc_input_delete(i);
   
   free(st.parsers);
+  free(st.names);
   va_end(va);
   return err;
 }
@@ -3667,7 +4510,11 @@ mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
   
   st.va = &va;
   st.parsers_num = 0;
+  st.parsers_slots = 0;
   st.parsers = NULL;
+  st.names_num = 0;
+  st.names_slots = 0;
+  st.names = NULL;
   st.flags = flags;
   
   i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
@@ -3675,6 +4522,7 @@ mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
   mpc_input_delete(i);
   
   free(st.parsers);
+  free(st.names);
   va_end(va);
   return err;
 }
@@ -3690,7 +4538,11 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   
   st.va = &va;
   st.parsers_num = 0;
+  st.parsers_slots = 0;
   st.parsers = NULL;
+  st.names_num = 0;
+  st.names_slots = 0;
+  st.names = NULL;
   st.flags = flags;
   
   i = mpc_input_new_string("<mpca_lang>", language);
@@ -3698,6 +4550,7 @@ mpc_err_t *mpca_lang(int flags, const char *language, ...) {
   mpc_input_delete(i);
   
   free(st.parsers);
+  free(st.names);
   va_end(va);
   return err;
 }
@@ -3721,7 +4574,11 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   
   st.va = &va;
   st.parsers_num = 0;
+  st.parsers_slots = 0;
   st.parsers = NULL;
+  st.names_num = 0;
+  st.names_slots = 0;
+  st.names = NULL;
   st.flags = flags;
   
   i = mpc_input_new_file(filename, f);
@@ -3729,6 +4586,7 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
   mpc_input_delete(i);
   
   free(st.parsers);
+  free(st.names);
   va_end(va);  
   
   fclose(f);
@@ -3784,6 +4642,139 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
+/*
+** Character Sets
+**
+** `mpc_optimise` turns `oneof`, `noneof` and `range`
+** parsers into a 256 bit set so each character
+** costs a single lookup rather than a `strchr`.
+** Runs of `or` alternatives that each match one
+** character are merged into a single set too.
+**
+** A failed `or` reports the expected message of
+** every alternative, so a merged set keeps these
+** in `ms` and adds them to the error in the same
+** way. Sets made from one parser keep no messages
+** as any `expect` around them is left in place.
+*/
+
+/* The one character parser under any `expect` and the message it fails with */
+static mpc_parser_t *mpc_charset_base(mpc_parser_t *p, const char **m) {
+  
+  *m = NULL;
+  while (!p->retained && p->type == MPC_TYPE_EXPECT) {
+    if (*m == NULL) { *m = p->data.expect.m; }
+    p = p->data.expect.x;
+  }
+  
+  if (p->retained) { return NULL; }
+  
+  switch (p->type) {
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      return p;
+    default: return NULL;
+  }
+  
+}
+
+/* Compares each character just as the `mpc_input` functions do */
+static void mpc_charset_add(unsigned char *x, mpc_parser_t *p) {
+  
+  int j;
+  char c;
+  
+  for (j = 0; j < 256; j++) {
+    c = (char)j;
+    if ((p->type == MPC_TYPE_SINGLE  && c == p->data.single.x)
+    ||  (p->type == MPC_TYPE_RANGE   && c >= p->data.range.x && c <= p->data.range.y)
+    ||  (p->type == MPC_TYPE_ONEOF   && strchr(p->data.string.x, c) != 0)
+    ||  (p->type == MPC_TYPE_NONEOF  && strchr(p->data.string.x, c) == 0)
+    ||  (p->type == MPC_TYPE_CHARSET && (p->data.charset.x[j >> 3] >> (j & 7)) & 1)) {
+      x[j >> 3] |= 1 << (j & 7);
+    }
+  }
+  
+}
+
+static void mpc_charset_add_expected(mpc_parser_t *p, const char *m) {
+  
+  int j;
+  
+  for (j = 0; j < p->data.charset.n; j++) {
+    if (strcmp(p->data.charset.ms[j], m) == 0) { return; }
+  }
+  
+  p->data.charset.n++;
+  p->data.charset.ms = realloc(p->data.charset.ms, sizeof(char*) * p->data.charset.n);
+  p->data.charset.ms[j] = malloc(strlen(m) + 1);
+  strcpy(p->data.charset.ms[j], m);
+  
+}
+
+static void mpc_charset_compile(mpc_parser_t *p) {
+  
+  unsigned char *x = calloc(32, 1);
+  
+  mpc_charset_add(x, p);
+  if (p->type == MPC_TYPE_ONEOF || p->type == MPC_TYPE_NONEOF) {
+    free(p->data.string.x);
+  }
+  
+  p->type = MPC_TYPE_CHARSET;
+  p->data.charset.x = x;
+  p->data.charset.n = 0;
+  p->data.charset.ms = NULL;
+  
+}
+
+/* Finds the first run of at least two one character alternatives */
+static int mpc_charset_run(mpc_parser_t *p, int *j, int *k) {
+  
+  const char *m;
+  
+  for (*j = 0; *j < p->data.or.n; *j = *k + 1) {
+    for (*k = *j; *k < p->data.or.n && mpc_charset_base(p->data.or.xs[*k], &m); (*k)++);
+    if (*k - *j > 1) { return 1; }
+  }
+  
+  return 0;
+}
+
+/* Replaces alternatives `j` up to `k` of an `or` with one set */
+static void mpc_charset_merge(mpc_parser_t *p, int j, int k) {
+  
+  int l, o;
+  const char *m;
+  mpc_parser_t *b, *c = mpc_undefined();
+  
+  c->type = MPC_TYPE_CHARSET;
+  c->data.charset.x = calloc(32, 1);
+  c->data.charset.n = 0;
+  c->data.charset.ms = NULL;
+  
+  for (l = j; l < k; l++) {
+    b = mpc_charset_base(p->data.or.xs[l], &m);
+    mpc_charset_add(c->data.charset.x, b);
+    if (m) {
+      mpc_charset_add_expected(c, m);
+    } else if (b->type == MPC_TYPE_CHARSET) {
+      for (o = 0; o < b->data.charset.n; o++) {
+        mpc_charset_add_expected(c, b->data.charset.ms[o]);
+      }
+    }
+    mpc_delete(p->data.or.xs[l]);
+  }
+  
+  p->data.or.xs[j] = c;
+  memmove(p->data.or.xs + j + 1, p->data.or.xs + k, (p->data.or.n - k) * sizeof(mpc_parser_t*));
+  p->data.or.n -= k - j - 1;
+  
+}
+
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   
   int i, n, m;
@@ -3791,6 +4782,13 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   
   if (p->retained && !force) { return; }
   
+  /* Drop any old trie as the alternatives may change */
+  
+  if (p->type == MPC_TYPE_OR) {
+    mpc_trie_delete(p->data.or.trie);
+    p->data.or.trie = NULL;
+  }
+  
   /* Optimise Subexpressions */
   
   if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
@@ -3830,6 +4828,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_trie_delete(t->data.or.trie);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -3844,6 +4843,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      mpc_trie_delete(t->data.or.trie);
       free(t->data.or.xs); free(t->name); free(t);
       continue;
     }
@@ -3947,6 +4947,39 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
     
+    /* Compile charset */
+    if (p->type == MPC_TYPE_ONEOF
+    ||  p->type == MPC_TYPE_NONEOF
+    ||  p->type == MPC_TYPE_RANGE) {
+      mpc_charset_compile(p);
+      continue;
+    }
+    
+    /* Merge charset `or` */
+    if (p->type == MPC_TYPE_OR && mpc_charset_run(p, &i, &n)) {
+      mpc_charset_merge(p, i, n);
+      continue;
+    }
+    
+    /* Remove charset `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.n == 1
+    &&  p->data.or.xs[0]->type == MPC_TYPE_CHARSET
+    && !p->data.or.xs[0]->retained) {
+      t = p->data.or.xs[0];
+      free(p->data.or.xs);
+      p->type = t->type;
+      p->data = t->data;
+      free(t->name); free(t);
+      continue;
+    }
+    
+    /* Index literal `or` */
+    if (p->type == MPC_TYPE_OR) {
+      mpc_trie_delete(p->data.or.trie);
+      p->data.or.trie = mpc_trie_new(p);
+    }
+    
     return;
     
   }
@@ -3957,3 +4990,1836 @@ void mpc_optimise(mpc_parser_t *p) {
   mpc_optimise_unretained(p, 1);
 }
 
+/*
+** Grammar Analysis
+**
+** `mpc_analyse` finds the parts of a grammar that
+** parse the same without backtracking and wraps
+** them in `mpc_predictive`, so they no longer mark
+** and rewind the input.
+**
+** For every parser it works out the characters it
+** can start with, if it can match nothing, if it
+** can fail and if it can fail after consuming some
+** input. Retained parsers make these depend on each
+** other so they are repeated until nothing changes.
+**
+** The input is only ever rewound past something
+** when a parser fails after consuming it. If no
+** `or`, `maybe`, `many`, `expect` or `not` inside a
+** parser carries on from such a failure then the
+** rewind cannot be seen from inside, and it is
+** safe to drop as long as whatever is around the
+** parser does not carry on either. An `and` rewinds
+** the whole sequence itself so is always safe to be
+** inside.
+**
+** Comparing the start characters of alternatives,
+** as an LL(1) check would, is not enough on its own
+** as mpc takes the first alternative that matches
+** rather than the only one. Overlaps are only used
+** to explain why a rule still needs backtracking.
+*/
+
+typedef struct {
+  unsigned char first[32];
+  char nullable;
+  char fails;
+  char partial;
+  char marks;
+  char backtracks;
+} mpc_analysis_t;
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_parser_t **ps;
+  mpc_analysis_t *as;
+  char *badref;
+  int *order;
+  int order_num;
+  int *index;
+  int index_slots;
+} mpc_analyse_st_t;
+
+static int mpc_analyse_children(mpc_parser_t *p, mpc_parser_t ***xs) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     *xs = &p->data.expect.x;     return 1;
+    case MPC_TYPE_PREDICT:    *xs = &p->data.predict.x;    return 1;
+    case MPC_TYPE_APPLY:      *xs = &p->data.apply.x;      return 1;
+    case MPC_TYPE_APPLY_TO:   *xs = &p->data.apply_to.x;   return 1;
+    case MPC_TYPE_CHECK:      *xs = &p->data.check.x;      return 1;
+    case MPC_TYPE_CHECK_WITH: *xs = &p->data.check_with.x; return 1;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      *xs = &p->data.not.x;        return 1;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      *xs = &p->data.repeat.x;     return 1;
+    case MPC_TYPE_OR:         *xs = p->data.or.xs;         return p->data.or.n;
+    case MPC_TYPE_AND:        *xs = p->data.and.xs;        return p->data.and.n;
+    default:                  *xs = NULL;                  return 0;
+  }
+}
+
+static int mpc_analyse_slot(mpc_analyse_st_t *st, mpc_parser_t *p) {
+  unsigned long h = (unsigned long)((size_t)p >> 3) * 2654435761UL;
+  h &= st->index_slots - 1;
+  while (st->index[h] && st->ps[st->index[h]-1] != p) {
+    h = (h + 1) & (st->index_slots - 1);
+  }
+  return h;
+}
+
+static mpc_analysis_t *mpc_analyse_get(mpc_analyse_st_t *st, mpc_parser_t *p) {
+  return &st->as[st->index[mpc_analyse_slot(st, p)]-1];
+}
+
+/* Numbers every parser reachable from `p`, children before their parents */
+static void mpc_analyse_add(mpc_analyse_st_t *st, mpc_parser_t *p) {
+  
+  int j, k, n, *index;
+  mpc_parser_t **xs;
+  
+  if (st->index[mpc_analyse_slot(st, p)]) { return; }
+  
+  if (st->num == st->slots) {
+    st->slots = st->slots * 2;
+    st->ps = realloc(st->ps, sizeof(mpc_parser_t*) * st->slots);
+    st->as = realloc(st->as, sizeof(mpc_analysis_t) * st->slots);
+    st->badref = realloc(st->badref, st->slots);
+    st->order = realloc(st->order, sizeof(int) * st->slots);
+  }
+  
+  if ((st->num + 1) * 2 > st->index_slots) {
+    index = st->index;
+    st->index = calloc(st->index_slots * 2, sizeof(int));
+    st->index_slots = st->index_slots * 2;
+    for (j = 0; j < st->num; j++) {
+      st->index[mpc_analyse_slot(st, st->ps[j])] = j+1;
+    }
+    free(index);
+  }
+  
+  k = st->num++;
+  st->ps[k] = p;
+  memset(&st->as[k], 0, sizeof(mpc_analysis_t));
+  st->badref[k] = 0;
+  st->index[mpc_analyse_slot(st, p)] = k+1;
+  
+  n = mpc_analyse_children(p, &xs);
+  for (j = 0; j < n; j++) { mpc_analyse_add(st, xs[j]); }
+  
+  st->order[st->order_num++] = k;
+}
+
+static void mpc_analyse_union(unsigned char *x, const unsigned char *y) {
+  int j;
+  for (j = 0; j < 32; j++) { x[j] |= y[j]; }
+}
+
+static int mpc_analyse_consumes(mpc_analysis_t *a) {
+  int j;
+  for (j = 0; j < 32; j++) { if (a->first[j]) { return 1; } }
+  return 0;
+}
+
+/* Works out `r` for `p` from what is known so far about its children */
+static void mpc_analyse_node(mpc_analyse_st_t *st, mpc_parser_t *p, mpc_analysis_t *r) {
+  
+  int j, n, consumed;
+  mpc_parser_t **xs;
+  mpc_analysis_t *x;
+  
+  memset(r, 0, sizeof(mpc_analysis_t));
+  n = mpc_analyse_children(p, &xs);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_FAIL:
+      r->fails = 1;
+      break;
+    
+    case MPC_TYPE_ANCHOR:
+      r->nullable = 1;
+      r->fails = 1;
+      break;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      memset(r->first, 0xFF, 32);
+      r->fails = 1;
+      break;
+    
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      mpc_charset_add(r->first, p);
+      r->fails = 1;
+      break;
+    
+    case MPC_TYPE_STRING:
+      j = (unsigned char)p->data.string.x[0];
+      if (j == 0) { r->nullable = 1; break; }
+      r->first[j >> 3] |= 1 << (j & 7);
+      r->fails = 1;
+      r->partial = p->data.string.x[1] != '\0';
+      r->marks = 1;
+      break;
+    
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_PREDICT:
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+      *r = *mpc_analyse_get(st, xs[0]);
+      if (p->type == MPC_TYPE_EXPECT) { r->backtracks |= r->partial; }
+      if (p->type == MPC_TYPE_PREDICT) { r->backtracks = 0; r->marks = 0; }
+      break;
+    
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      *r = *mpc_analyse_get(st, xs[0]);
+      r->partial |= mpc_analyse_consumes(r);
+      r->fails = 1;
+      break;
+    
+    case MPC_TYPE_NOT:
+      x = mpc_analyse_get(st, xs[0]);
+      r->nullable = 1;
+      r->fails = 1;
+      r->marks = 1;
+      r->backtracks = x->backtracks || mpc_analyse_consumes(x);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+      *r = *mpc_analyse_get(st, xs[0]);
+      r->backtracks |= r->partial;
+      r->nullable = 1;
+      r->fails = 0;
+      r->partial = 0;
+      break;
+    
+    case MPC_TYPE_MANY1:
+      *r = *mpc_analyse_get(st, xs[0]);
+      r->backtracks |= r->partial;
+      break;
+    
+    case MPC_TYPE_COUNT:
+      *r = *mpc_analyse_get(st, xs[0]);
+      r->partial |= p->data.repeat.n > 1 && r->fails && mpc_analyse_consumes(r);
+      break;
+    
+    case MPC_TYPE_OR:
+      if (n == 0) { r->nullable = 1; break; }
+      r->fails = 1;
+      r->marks = p->data.or.trie != NULL;
+      for (j = 0; j < n; j++) {
+        x = mpc_analyse_get(st, xs[j]);
+        mpc_analyse_union(r->first, x->first);
+        r->nullable |= x->nullable;
+        r->fails &= x->fails;
+        r->partial |= x->partial;
+        r->marks |= x->marks;
+        r->backtracks |= x->backtracks || (x->partial && j < n-1);
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      if (n == 0) { r->nullable = 1; break; }
+      r->nullable = 1;
+      r->marks = 1;
+      consumed = 0;
+      for (j = 0; j < n; j++) {
+        x = mpc_analyse_get(st, xs[j]);
+        if (r->nullable) { mpc_analyse_union(r->first, x->first); }
+        r->nullable &= x->nullable;
+        r->fails |= x->fails;
+        r->partial |= x->partial || (consumed && x->fails);
+        r->backtracks |= x->backtracks;
+        consumed |= mpc_analyse_consumes(x);
+      }
+      break;
+    
+    default:
+      r->nullable = 1;
+      break;
+  }
+  
+}
+
+/* If `a` parses the same predictively where a failure after consuming input is or is not `safe` */
+static int mpc_analyse_predictable(mpc_analysis_t *a, int safe) {
+  return !a->backtracks && a->marks && (safe || !a->partial);
+}
+
+/* If a failure of child `j` after consuming input is safe given it is `safe` for `p` */
+static int mpc_analyse_inner(mpc_parser_t *p, int j, int safe) {
+  switch (p->type) {
+    case MPC_TYPE_AND: return 1;
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+    case MPC_TYPE_COUNT: return safe;
+    case MPC_TYPE_OR: return safe && j == p->data.or.n-1;
+    default: return 0;
+  }
+}
+
+static void mpc_analyse_wrap(mpc_parser_t *p) {
+  mpc_parser_t *q = mpc_undefined();
+  q->type = p->type;
+  q->data = p->data;
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = q;
+}
+
+/*
+** Walks down from `p` to the largest parsers that
+** can be made predictive, wrapping them if `wrap`
+** is set. Uses of retained parsers where a failure
+** after consuming input is not safe are noted as
+** these stop the retained parser being wrapped.
+*/
+static void mpc_analyse_mark(mpc_analyse_st_t *st, mpc_parser_t *p, int safe, int root, int wrap) {
+  
+  int j, n, k;
+  mpc_parser_t **xs;
+  
+  k = st->index[mpc_analyse_slot(st, p)]-1;
+  
+  if (p->retained && !root) {
+    if (!safe) { st->badref[k] = 1; }
+    return;
+  }
+  
+  if (p->type == MPC_TYPE_PREDICT) { return; }
+  
+  if (!root && mpc_analyse_predictable(&st->as[k], safe)) {
+    if (wrap) { mpc_analyse_wrap(p); }
+    return;
+  }
+  
+  n = mpc_analyse_children(p, &xs);
+  for (j = 0; j < n; j++) {
+    mpc_analyse_mark(st, xs[j], mpc_analyse_inner(p, j, safe), 0, wrap);
+  }
+  
+}
+
+/* Prints the first reason found under `p` that it needs backtracking */
+static int mpc_analyse_why(mpc_analyse_st_t *st, mpc_parser_t *p, int root, FILE *f) {
+  
+  int j, k, c, n;
+  mpc_parser_t **xs;
+  mpc_analysis_t *a, *x, *y;
+  
+  a = mpc_analyse_get(st, p);
+  
+  if (p->type == MPC_TYPE_PREDICT || !a->backtracks) { return 0; }
+  
+  if (p->retained && !root) {
+    fprintf(f, "uses <%s>", p->name);
+    return 1;
+  }
+  
+  n = mpc_analyse_children(p, &xs);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < n-1; j++) {
+        x = mpc_analyse_get(st, xs[j]);
+        if (!x->partial) { continue; }
+        for (k = j+1; k < n; k++) {
+          y = mpc_analyse_get(st, xs[k]);
+          for (c = 1; c < 256; c++) {
+            if ((x->first[c >> 3] & y->first[c >> 3]) & (1 << (c & 7))) {
+              fprintf(f, "alternatives %i and %i can both start with %s",
+                j+1, k+1, mpc_err_char_unescape((char)c));
+              return 1;
+            }
+          }
+        }
+        fprintf(f, "alternative %i can fail after consuming input", j+1);
+        return 1;
+      }
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      if (mpc_analyse_get(st, xs[0])->partial) {
+        fprintf(f, "%s can fail after consuming input", p->data.expect.m);
+        return 1;
+      }
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (mpc_analyse_get(st, xs[0])->partial) {
+        fprintf(f, "repeated or optional part can fail after consuming input");
+        return 1;
+      }
+      break;
+    
+    case MPC_TYPE_NOT:
+      if (mpc_analyse_consumes(mpc_analyse_get(st, xs[0]))) {
+        fprintf(f, "`not` looks ahead by consuming input");
+        return 1;
+      }
+      break;
+    
+    default: break;
+  }
+  
+  for (j = 0; j < n; j++) {
+    if (mpc_analyse_why(st, xs[j], 0, f)) { return 1; }
+  }
+  
+  return 0;
+}
+
+int mpc_analyse(mpc_parser_t *p, FILE *f) {
+  
+  int j, k, changed, count;
+  mpc_parser_t *q;
+  mpc_analysis_t a;
+  mpc_analyse_st_t st;
+  
+  st.num = 0;
+  st.slots = 64;
+  st.ps = malloc(sizeof(mpc_parser_t*) * st.slots);
+  st.as = malloc(sizeof(mpc_analysis_t) * st.slots);
+  st.badref = malloc(st.slots);
+  st.order = malloc(sizeof(int) * st.slots);
+  st.order_num = 0;
+  st.index_slots = 128;
+  st.index = calloc(st.index_slots, sizeof(int));
+  
+  mpc_analyse_add(&st, p);
+  
+  do {
+    changed = 0;
+    for (j = 0; j < st.order_num; j++) {
+      k = st.order[j];
+      mpc_analyse_node(&st, st.ps[k], &a);
+      if (memcmp(&a, &st.as[k], sizeof(mpc_analysis_t)) != 0) {
+        st.as[k] = a;
+        changed = 1;
+      }
+    }
+  } while (changed);
+  
+  /* Find where retained parsers are used then wrap those that can be */
+  do {
+    changed = 0;
+    for (j = 0; j < st.num; j++) { changed -= st.badref[j]; }
+    for (j = 0; j < st.num; j++) {
+      q = st.ps[j];
+      if (q == p || q->retained) {
+        mpc_analyse_mark(&st, q, q == p || !st.badref[j], q->retained, 0);
+      }
+    }
+    for (j = 0; j < st.num; j++) { changed += st.badref[j]; }
+  } while (changed);
+  
+  for (j = 0; j < st.num; j++) {
+    q = st.ps[j];
+    if (q->retained && q->type != MPC_TYPE_PREDICT
+    &&  mpc_analyse_predictable(&st.as[j], q == p || !st.badref[j])) {
+      mpc_analyse_wrap(q);
+    }
+  }
+  
+  for (j = 0; j < st.num; j++) {
+    q = st.ps[j];
+    if (q == p || q->retained) {
+      mpc_analyse_mark(&st, q, q == p || !st.badref[j], q->retained, 1);
+    }
+  }
+  
+  /* Anything retained still marking the input needs backtracking */
+  count = 0;
+  for (j = 0; j < st.num; j++) {
+    q = st.ps[j];
+    if (!q->retained || q->type == MPC_TYPE_PREDICT || !st.as[j].marks) { continue; }
+    count++;
+    if (f == NULL) { continue; }
+    fprintf(f, "<%s>: ", q->name);
+    if (!mpc_analyse_why(&st, q, 1, f)) {
+      fprintf(f, "can fail after consuming input where it is used");
+    }
+    fprintf(f, "\n");
+  }
+  
+  free(st.ps);
+  free(st.as);
+  free(st.badref);
+  free(st.order);
+  free(st.index);
+  
+  return count;
+}
+
+/*
+** Code Generation
+*/
+
+/*
+** `mpc_codegen` writes a parser out as C source.
+**
+** Every node of the parser becomes its own small
+** static function and retained parsers become
+** shared ones, so the result has the same shape
+** as the combinator graph but with every
+** character test written inline and no dispatch
+** on parser type at run time. The generated
+** functions follow `mpc_parse_run` case by case,
+** so they give the same output and the same
+** errors for any string input.
+**
+** Errors are only wanted when a parse fails, so
+** the generated parser first runs with errors
+** suppressed and builds them in a second run
+** only over input that did not parse.
+**
+** Function pointers such as folds can only be
+** written out by name, so only the public `mpcf_*`
+** functions and the AST functions used by
+** `mpca_lang` are supported. Anything else gives
+** an error and nothing is written.
+*/
+
+static const char *mpc_codegen_prelude[] = {
+  "#include \"mpc.h\"",
+  "",
+  "typedef struct {",
+  "  const char *filename;",
+  "  const char *string;",
+  "  long length;",
+  "  mpc_state_t state;",
+  "  char last;",
+  "  int suppress;",
+  "  int backtrack;",
+  "} mpcg_input_t;",
+  "",
+  "static char mpcg_peekc(mpcg_input_t *i) {",
+  "  return i->state.pos < i->length ? i->string[i->state.pos] : '\\0';",
+  "}",
+  "",
+  "static int mpcg_success(mpcg_input_t *i, char **o) {",
+  "  char c = i->string[i->state.pos];",
+  "  i->last = c;",
+  "  i->state.pos++;",
+  "  i->state.col++;",
+  "  if (c == '\\n') {",
+  "    i->state.col = 0;",
+  "    i->state.row++;",
+  "  }",
+  "  if (o) {",
+  "    *o = malloc(2);",
+  "    (*o)[0] = c;",
+  "    (*o)[1] = '\\0';",
+  "  }",
+  "  return 1;",
+  "}",
+  "",
+  "static char *mpcg_strdup(const char *s) {",
+  "  char *x = malloc(strlen(s) + 1);",
+  "  strcpy(x, s);",
+  "  return x;",
+  "}",
+  "",
+  "static mpc_err_t *mpcg_err_new(mpcg_input_t *i, const char *expected) {",
+  "  mpc_err_t *x;",
+  "  if (i->suppress) { return NULL; }",
+  "  x = malloc(sizeof(mpc_err_t));",
+  "  x->filename = mpcg_strdup(i->filename);",
+  "  x->state = i->state;",
+  "  x->expected_num = 1;",
+  "  x->expected = malloc(sizeof(char*));",
+  "  x->expected[0] = mpcg_strdup(expected);",
+  "  x->failure = NULL;",
+  "  x->recieved = mpcg_peekc(i);",
+  "  return x;",
+  "}",
+  "",
+  "static mpc_err_t *mpcg_err_fail(mpcg_input_t *i, const char *failure) {",
+  "  mpc_err_t *x;",
+  "  if (i->suppress) { return NULL; }",
+  "  x = malloc(sizeof(mpc_err_t));",
+  "  x->filename = mpcg_strdup(i->filename);",
+  "  x->state = i->state;",
+  "  x->expected_num = 0;",
+  "  x->expected = NULL;",
+  "  x->failure = mpcg_strdup(failure);",
+  "  x->recieved = ' ';",
+  "  return x;",
+  "}",
+  "",
+  "static void mpcg_err_delete(mpc_err_t *x) {",
+  "  if (x) { mpc_err_delete(x); }",
+  "}",
+  "",
+  "static mpc_err_t *mpcg_err_merge(mpc_err_t *x, mpc_err_t *y) {",
+  "  ",
+  "  int j, k, l;",
+  "  mpc_err_t *xs[2], *e;",
+  "  ",
+  "  xs[0] = x;",
+  "  xs[1] = y;",
+  "  ",
+  "  if (x == NULL && y == NULL) { return NULL; }",
+  "  ",
+  "  e = malloc(sizeof(mpc_err_t));",
+  "  e->state.pos = -1;",
+  "  e->state.row = -1;",
+  "  e->state.col = -1;",
+  "  e->expected_num = 0;",
+  "  e->expected = NULL;",
+  "  e->failure = NULL;",
+  "  e->filename = mpcg_strdup(y ? y->filename : x->filename);",
+  "  ",
+  "  for (j = 0; j < 2; j++) {",
+  "    if (xs[j] == NULL) { continue; }",
+  "    if (xs[j]->state.pos > e->state.pos) { e->state = xs[j]->state; }",
+  "  }",
+  "  ",
+  "  for (j = 0; j < 2; j++) {",
+  "    if (xs[j] == NULL) { continue; }",
+  "    if (xs[j]->state.pos < e->state.pos) { continue; }",
+  "    ",
+  "    if (xs[j]->failure) {",
+  "      e->failure = mpcg_strdup(xs[j]->failure);",
+  "      break;",
+  "    }",
+  "    ",
+  "    e->recieved = xs[j]->recieved;",
+  "    ",
+  "    for (k = 0; k < xs[j]->expected_num; k++) {",
+  "      for (l = 0; l < e->expected_num; l++) {",
+  "        if (strcmp(e->expected[l], xs[j]->expected[k]) == 0) { break; }",
+  "      }",
+  "      if (l < e->expected_num) { continue; }",
+  "      e->expected_num++;",
+  "      e->expected = realloc(e->expected, sizeof(char*) * e->expected_num);",
+  "      e->expected[e->expected_num-1] = mpcg_strdup(xs[j]->expected[k]);",
+  "    }",
+  "  }",
+  "  ",
+  "  mpcg_err_delete(x);",
+  "  mpcg_err_delete(y);",
+  "  return e;",
+  "}",
+  "",
+  "static mpc_err_t *mpcg_err_repeat(mpc_err_t *x, const char *prefix) {",
+  "  ",
+  "  int j;",
+  "  size_t l;",
+  "  char *expect;",
+  "  ",
+  "  if (x == NULL) { return NULL; }",
+  "  ",
+  "  if (x->expected_num == 0) {",
+  "    x->expected_num = 1;",
+  "    x->expected = realloc(x->expected, sizeof(char*));",
+  "    x->expected[0] = calloc(1, 1);",
+  "    return x;",
+  "  }",
+  "  ",
+  "  l = strlen(prefix);",
+  "  for (j = 0; j < x->expected_num; j++) { l += strlen(x->expected[j]) + strlen(\", \"); }",
+  "  ",
+  "  expect = malloc(l + 1);",
+  "  strcpy(expect, prefix);",
+  "  for (j = 0; j < x->expected_num; j++) {",
+  "    if (j > 0 && j == x->expected_num-1) { strcat(expect, \" or \"); }",
+  "    else if (j > 0) { strcat(expect, \", \"); }",
+  "    strcat(expect, x->expected[j]);",
+  "    free(x->expected[j]);",
+  "  }",
+  "  ",
+  "  x->expected_num = 1;",
+  "  x->expected[0] = expect;",
+  "  return x;",
+  "}",
+  "",
+  "static void mpcg_mark(mpcg_input_t *i, mpc_state_t *s, char *l) {",
+  "  *s = i->state;",
+  "  *l = i->last;",
+  "}",
+  "",
+  "static void mpcg_rewind(mpcg_input_t *i, mpc_state_t *s, char *l) {",
+  "  if (i->backtrack < 1) { return; }",
+  "  i->state = *s;",
+  "  i->last = *l;",
+  "}",
+  NULL
+};
+
+static const char *mpc_codegen_prelude_boundary[] = {
+  "",
+  "static int mpcg_boundary(char prev, char next) {",
+  "  const char* word = \"abcdefghijklmnopqrstuvwxyz\"",
+  "                     \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"",
+  "                     \"0123456789_\";",
+  "  if ( strchr(word, next) &&  prev == '\\0') { return 1; }",
+  "  if ( strchr(word, prev) &&  next == '\\0') { return 1; }",
+  "  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }",
+  "  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }",
+  "  return 0;",
+  "}",
+  NULL
+};
+
+static const char *mpc_codegen_prelude_count[] = {
+  "",
+  "static mpc_err_t *mpcg_err_count(mpc_err_t *x, int n) {",
+  "  char prefix[32];",
+  "  sprintf(prefix, \"%i of \", n);",
+  "  return mpcg_err_repeat(x, prefix);",
+  "}",
+  NULL
+};
+
+typedef struct {
+  FILE *f;
+  int nodes_num;
+  int nodes_num_total;
+  int retained_num;
+  mpc_parser_t **retained;
+  int *retained_ids;
+  char *failure;
+  int boundary;
+  int count;
+} mpc_codegen_t;
+
+static void mpc_codegen_printf(mpc_codegen_t *g, const char *fmt, ...) {
+  va_list va;
+  if (g->f == NULL) { return; }
+  va_start(va, fmt);
+  vfprintf(g->f, fmt, va);
+  va_end(va);
+}
+
+static void mpc_codegen_unsupported(mpc_codegen_t *g, const char *what) {
+  if (g->failure) { return; }
+  g->failure = malloc(strlen(what) + 64);
+  sprintf(g->failure, "Cannot generate code for %s!", what);
+}
+
+static void mpc_codegen_char(mpc_codegen_t *g, char c) {
+  if (c == '\'' || c == '\\') { mpc_codegen_printf(g, "'\\%c'", c); }
+  else if (c >= 32 && c < 127) { mpc_codegen_printf(g, "'%c'", c); }
+  else { mpc_codegen_printf(g, "'\\%03o'", (unsigned char)c); }
+}
+
+static void mpc_codegen_string(mpc_codegen_t *g, const char *s) {
+  mpc_codegen_printf(g, "\"");
+  while (*s) {
+    if (*s == '"' || *s == '\\' || *s == '?') { mpc_codegen_printf(g, "\\%c", *s); }
+    else if (*s >= 32 && *s < 127) { mpc_codegen_printf(g, "%c", *s); }
+    else { mpc_codegen_printf(g, "\\%03o", (unsigned char)*s); }
+    s++;
+  }
+  mpc_codegen_printf(g, "\"");
+}
+
+static const char *mpc_codegen_fold(mpc_fold_t f) {
+  if (f == mpcf_null)      { return "mpcf_null"; }
+  if (f == mpcf_fst)       { return "mpcf_fst"; }
+  if (f == mpcf_snd)       { return "mpcf_snd"; }
+  if (f == mpcf_trd)       { return "mpcf_trd"; }
+  if (f == mpcf_fst_free)  { return "mpcf_fst_free"; }
+  if (f == mpcf_snd_free)  { return "mpcf_snd_free"; }
+  if (f == mpcf_trd_free)  { return "mpcf_trd_free"; }
+  if (f == mpcf_strfold)   { return "mpcf_strfold"; }
+  if (f == mpcf_maths)     { return "mpcf_maths"; }
+  if (f == mpcf_fold_ast)  { return "mpcf_fold_ast"; }
+  if (f == mpcf_state_ast) { return "mpcf_state_ast"; }
+  return NULL;
+}
+
+static const char *mpc_codegen_apply(mpc_apply_t f) {
+  if (f == mpcf_free)                { return "mpcf_free"; }
+  if (f == mpcf_int)                 { return "mpcf_int"; }
+  if (f == mpcf_hex)                 { return "mpcf_hex"; }
+  if (f == mpcf_oct)                 { return "mpcf_oct"; }
+  if (f == mpcf_float)               { return "mpcf_float"; }
+  if (f == mpcf_strtriml)            { return "mpcf_strtriml"; }
+  if (f == mpcf_strtrimr)            { return "mpcf_strtrimr"; }
+  if (f == mpcf_strtrim)             { return "mpcf_strtrim"; }
+  if (f == mpcf_escape)              { return "mpcf_escape"; }
+  if (f == mpcf_escape_regex)        { return "mpcf_escape_regex"; }
+  if (f == mpcf_escape_string_raw)   { return "mpcf_escape_string_raw"; }
+  if (f == mpcf_escape_char_raw)     { return "mpcf_escape_char_raw"; }
+  if (f == mpcf_unescape)            { return "mpcf_unescape"; }
+  if (f == mpcf_unescape_regex)      { return "mpcf_unescape_regex"; }
+  if (f == mpcf_unescape_string_raw) { return "mpcf_unescape_string_raw"; }
+  if (f == mpcf_unescape_char_raw)   { return "mpcf_unescape_char_raw"; }
+  if (f == mpcf_str_ast)             { return "mpcf_str_ast"; }
+  if (f == (mpc_apply_t)mpc_ast_add_root) { return "mpc_ast_add_root"; }
+  return NULL;
+}
+
+static const char *mpc_codegen_apply_to(mpc_apply_to_t f) {
+  if (f == (mpc_apply_to_t)mpc_ast_tag)     { return "mpc_ast_tag"; }
+  if (f == (mpc_apply_to_t)mpc_ast_add_tag) { return "mpc_ast_add_tag"; }
+  return NULL;
+}
+
+static const char *mpc_codegen_ctor(mpc_ctor_t f) {
+  if (f == mpcf_ctor_null) { return "mpcf_ctor_null"; }
+  if (f == mpcf_ctor_str)  { return "mpcf_ctor_str"; }
+  return NULL;
+}
+
+static const char *mpc_codegen_dtor(mpc_dtor_t f) {
+  if (f == free)                        { return "free"; }
+  if (f == mpcf_dtor_null)              { return "mpcf_dtor_null"; }
+  if (f == (mpc_dtor_t)mpc_ast_delete)  { return "mpc_ast_delete"; }
+  if (f == (mpc_dtor_t)mpc_delete)      { return "mpc_delete"; }
+  return NULL;
+}
+
+static const char *mpc_codegen_anchor(int(*f)(char,char)) {
+  if (f == mpc_soi_anchor)      { return "i->last == '\\0'"; }
+  if (f == mpc_eoi_anchor)      { return "mpcg_peekc(i) == '\\0'"; }
+  if (f == mpc_boundary_anchor) { return "mpcg_boundary(i->last, mpcg_peekc(i))"; }
+  return NULL;
+}
+
+static const char *mpc_codegen_name(mpc_codegen_t *g, const char *name, const char *what) {
+  if (name == NULL) { mpc_codegen_unsupported(g, what); return "NULL"; }
+  return name;
+}
+
+static void mpc_codegen_set(mpc_codegen_t *g, mpc_parser_t *p) {
+  
+  int j;
+  unsigned char set[32];
+  
+  memset(set, 0, sizeof(set));
+  mpc_charset_add(set, p);
+  
+  mpc_codegen_printf(g, "  static const unsigned char set[32] = {");
+  for (j = 0; j < 32; j++) {
+    mpc_codegen_printf(g, "%s%i", j ? ", " : "", set[j]);
+  }
+  mpc_codegen_printf(g, "};\n");
+  mpc_codegen_printf(g, "  unsigned char c = (unsigned char)i->string[i->state.pos];\n");
+  mpc_codegen_printf(g, "  (void) e;\n");
+  mpc_codegen_printf(g, "  if (i->state.pos < i->length && (set[c >> 3] >> (c & 7)) & 1) { return mpcg_success(i, (char**)&r->output); }\n");
+  if (p->type == MPC_TYPE_CHARSET && p->data.charset.n > 0) {
+    mpc_codegen_printf(g, "  if (!i->suppress) {\n");
+    for (j = 0; j < p->data.charset.n; j++) {
+      mpc_codegen_printf(g, "    *e = mpcg_err_merge(*e, mpcg_err_new(i, ");
+      mpc_codegen_string(g, p->data.charset.ms[j]);
+      mpc_codegen_printf(g, "));\n");
+    }
+    mpc_codegen_printf(g, "  }\n");
+  }
+  mpc_codegen_printf(g, "  r->error = NULL;\n");
+  mpc_codegen_printf(g, "  return 0;\n");
+}
+
+static void mpc_codegen_results(mpc_codegen_t *g) {
+  mpc_codegen_printf(g, "  mpc_result_t stk[4], *rs = stk;\n");
+  mpc_codegen_printf(g, "  int j = 0, slots = 4;\n");
+}
+
+static void mpc_codegen_repeat(mpc_codegen_t *g, int x) {
+  mpc_codegen_printf(g, "  while (mpcg_p%i(i, &rs[j], e)) {\n", x);
+  mpc_codegen_printf(g, "    j++;\n");
+  mpc_codegen_printf(g, "    if (j == slots) {\n");
+  mpc_codegen_printf(g, "      slots = j + j / 2;\n");
+  mpc_codegen_printf(g, "      rs = rs == stk ? memcpy(malloc(sizeof(mpc_result_t) * slots), stk, sizeof(stk))\n");
+  mpc_codegen_printf(g, "                     : realloc(rs, sizeof(mpc_result_t) * slots);\n");
+  mpc_codegen_printf(g, "    }\n");
+  mpc_codegen_printf(g, "  }\n");
+}
+
+static int mpc_codegen_node(mpc_codegen_t *g, mpc_parser_t *p, int force);
+
+static void mpc_codegen_body(mpc_codegen_t *g, mpc_parser_t *p, int id) {
+  
+  int j, x = -1, *xs = NULL;
+  const char *f, *dx;
+  
+  /* Children are written out first so the text of this function is not split */
+  
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   x = mpc_codegen_node(g, p->data.expect.x, 0);   break;
+    case MPC_TYPE_APPLY:    x = mpc_codegen_node(g, p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: x = mpc_codegen_node(g, p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  x = mpc_codegen_node(g, p->data.predict.x, 0);  break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    x = mpc_codegen_node(g, p->data.not.x, 0);      break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    x = mpc_codegen_node(g, p->data.repeat.x, 0);   break;
+    case MPC_TYPE_OR:
+      xs = malloc(sizeof(int) * (p->data.or.n + 1));
+      for (j = 0; j < p->data.or.n; j++) { xs[j] = mpc_codegen_node(g, p->data.or.xs[j], 0); }
+      break;
+    case MPC_TYPE_AND:
+      xs = malloc(sizeof(int) * (p->data.and.n + 1));
+      for (j = 0; j < p->data.and.n; j++) { xs[j] = mpc_codegen_node(g, p->data.and.xs[j], 0); }
+      break;
+    default: break;
+  }
+  
+  mpc_codegen_printf(g, "\n");
+  if (p->retained && p->name) {
+    mpc_codegen_printf(g, "/* <");
+    for (f = p->name; *f; f++) {
+      if (isalnum((unsigned char)*f) || *f == '_') { mpc_codegen_printf(g, "%c", *f); }
+    }
+    mpc_codegen_printf(g, "> */\n");
+  }
+  mpc_codegen_printf(g, "static int mpcg_p%i(mpcg_input_t *i, mpc_result_t *r, mpc_err_t **e) {\n", id);
+  
+  switch (p->type) {
+    
+    /* Basic Parsers */
+    
+    case MPC_TYPE_ANY:
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  if (i->state.pos < i->length) { return mpcg_success(i, (char**)&r->output); }\n");
+      mpc_codegen_printf(g, "  r->error = NULL;\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_SINGLE:
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  if (i->state.pos < i->length && i->string[i->state.pos] == ");
+      mpc_codegen_char(g, p->data.single.x);
+      mpc_codegen_printf(g, ") { return mpcg_success(i, (char**)&r->output); }\n");
+      mpc_codegen_printf(g, "  r->error = NULL;\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_RANGE:
+      mpc_codegen_printf(g, "  char c = i->string[i->state.pos];\n");
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  if (i->state.pos < i->length && c >= ");
+      mpc_codegen_char(g, p->data.range.x);
+      mpc_codegen_printf(g, " && c <= ");
+      mpc_codegen_char(g, p->data.range.y);
+      mpc_codegen_printf(g, ") { return mpcg_success(i, (char**)&r->output); }\n");
+      mpc_codegen_printf(g, "  r->error = NULL;\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      mpc_codegen_set(g, p);
+      break;
+    
+    case MPC_TYPE_STRING:
+      mpc_codegen_printf(g, "  mpc_state_t s;\n");
+      mpc_codegen_printf(g, "  char l;\n");
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  mpcg_mark(i, &s, &l);\n");
+      for (f = p->data.string.x; *f; f++) {
+        mpc_codegen_printf(g, "  if (i->state.pos >= i->length || i->string[i->state.pos] != ");
+        mpc_codegen_char(g, *f);
+        mpc_codegen_printf(g, ") { goto fail; }\n");
+        mpc_codegen_printf(g, "  mpcg_success(i, NULL);\n");
+      }
+      mpc_codegen_printf(g, "  r->output = mpcg_strdup(");
+      mpc_codegen_string(g, p->data.string.x);
+      mpc_codegen_printf(g, ");\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      mpc_codegen_printf(g, "fail:\n");
+      mpc_codegen_printf(g, "  mpcg_rewind(i, &s, &l);\n");
+      mpc_codegen_printf(g, "  r->error = NULL;\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_ANCHOR:
+      g->boundary |= p->data.anchor.f == mpc_boundary_anchor;
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  r->output = NULL;\n");
+      mpc_codegen_printf(g, "  if (%s) { return 1; }\n",
+        mpc_codegen_name(g, mpc_codegen_anchor(p->data.anchor.f), "anchor function"));
+      mpc_codegen_printf(g, "  r->error = NULL;\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_SATISFY:
+      mpc_codegen_unsupported(g, "satisfy function");
+      break;
+    
+    /* Other parsers */
+    
+    case MPC_TYPE_UNDEFINED:
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  r->error = mpcg_err_fail(i, \"Parser Undefined!\");\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_PASS:
+      mpc_codegen_printf(g, "  (void) i; (void) e;\n");
+      mpc_codegen_printf(g, "  r->output = NULL;\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_FAIL:
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  r->error = mpcg_err_fail(i, ");
+      mpc_codegen_string(g, p->data.fail.m);
+      mpc_codegen_printf(g, ");\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_LIFT:
+      mpc_codegen_printf(g, "  (void) i; (void) e;\n");
+      mpc_codegen_printf(g, "  r->output = %s();\n",
+        mpc_codegen_name(g, mpc_codegen_ctor(p->data.lift.lf), "lift function"));
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x != NULL) { mpc_codegen_unsupported(g, "lifted value"); }
+      mpc_codegen_printf(g, "  (void) i; (void) e;\n");
+      mpc_codegen_printf(g, "  r->output = NULL;\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_STATE:
+      mpc_codegen_printf(g, "  (void) e;\n");
+      mpc_codegen_printf(g, "  r->output = malloc(sizeof(mpc_state_t));\n");
+      mpc_codegen_printf(g, "  *(mpc_state_t*)r->output = i->state;\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    /* Application Parsers */
+    
+    case MPC_TYPE_APPLY:
+      mpc_codegen_printf(g, "  if (!mpcg_p%i(i, r, e)) { return 0; }\n", x);
+      mpc_codegen_printf(g, "  r->output = %s(r->output);\n",
+        mpc_codegen_name(g, mpc_codegen_apply(p->data.apply.f), "apply function"));
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      mpc_codegen_printf(g, "  if (!mpcg_p%i(i, r, e)) { return 0; }\n", x);
+      mpc_codegen_printf(g, "  r->output = %s(r->output, ",
+        mpc_codegen_name(g, mpc_codegen_apply_to(p->data.apply_to.f), "apply_to function"));
+      mpc_codegen_string(g, mpc_codegen_apply_to(p->data.apply_to.f) ? p->data.apply_to.d : "");
+      mpc_codegen_printf(g, ");\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      mpc_codegen_unsupported(g, "check function");
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_codegen_printf(g, "  i->suppress++;\n");
+      mpc_codegen_printf(g, "  if (mpcg_p%i(i, r, e)) {\n", x);
+      mpc_codegen_printf(g, "    i->suppress--;\n");
+      mpc_codegen_printf(g, "    return 1;\n");
+      mpc_codegen_printf(g, "  }\n");
+      mpc_codegen_printf(g, "  i->suppress--;\n");
+      mpc_codegen_printf(g, "  mpcg_err_delete(r->error);\n");
+      mpc_codegen_printf(g, "  r->error = mpcg_err_new(i, ");
+      mpc_codegen_string(g, p->data.expect.m);
+      mpc_codegen_printf(g, ");\n");
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    case MPC_TYPE_PREDICT:
+      mpc_codegen_printf(g, "  int x;\n");
+      mpc_codegen_printf(g, "  i->backtrack--;\n");
+      mpc_codegen_printf(g, "  x = mpcg_p%i(i, r, e);\n", x);
+      mpc_codegen_printf(g, "  i->backtrack++;\n");
+      mpc_codegen_printf(g, "  return x;\n");
+      break;
+    
+    /* Optional Parsers */
+    
+    case MPC_TYPE_NOT:
+      mpc_codegen_printf(g, "  mpc_state_t s;\n");
+      mpc_codegen_printf(g, "  char l;\n");
+      mpc_codegen_printf(g, "  mpcg_mark(i, &s, &l);\n");
+      mpc_codegen_printf(g, "  i->suppress++;\n");
+      mpc_codegen_printf(g, "  if (mpcg_p%i(i, r, e)) {\n", x);
+      mpc_codegen_printf(g, "    mpcg_rewind(i, &s, &l);\n");
+      mpc_codegen_printf(g, "    i->suppress--;\n");
+      mpc_codegen_printf(g, "    %s(r->output);\n",
+        mpc_codegen_name(g, mpc_codegen_dtor(p->data.not.dx), "destructor"));
+      mpc_codegen_printf(g, "    r->error = mpcg_err_new(i, \"opposite\");\n");
+      mpc_codegen_printf(g, "    return 0;\n");
+      mpc_codegen_printf(g, "  }\n");
+      mpc_codegen_printf(g, "  i->suppress--;\n");
+      mpc_codegen_printf(g, "  mpcg_err_delete(r->error);\n");
+      mpc_codegen_printf(g, "  r->output = %s();\n",
+        mpc_codegen_name(g, mpc_codegen_ctor(p->data.not.lf), "lift function"));
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_MAYBE:
+      mpc_codegen_printf(g, "  if (mpcg_p%i(i, r, e)) { return 1; }\n", x);
+      mpc_codegen_printf(g, "  *e = mpcg_err_merge(*e, r->error);\n");
+      mpc_codegen_printf(g, "  r->output = %s();\n",
+        mpc_codegen_name(g, mpc_codegen_ctor(p->data.not.lf), "lift function"));
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    /* Repeat Parsers */
+    
+    case MPC_TYPE_MANY:
+      f = mpc_codegen_name(g, mpc_codegen_fold(p->data.repeat.f), "fold function");
+      mpc_codegen_results(g);
+      mpc_codegen_repeat(g, x);
+      mpc_codegen_printf(g, "  *e = mpcg_err_merge(*e, rs[j].error);\n");
+      mpc_codegen_printf(g, "  r->output = %s(j, (mpc_val_t**)rs);\n", f);
+      mpc_codegen_printf(g, "  if (rs != stk) { free(rs); }\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_MANY1:
+      f = mpc_codegen_name(g, mpc_codegen_fold(p->data.repeat.f), "fold function");
+      mpc_codegen_results(g);
+      mpc_codegen_repeat(g, x);
+      mpc_codegen_printf(g, "  if (j == 0) {\n");
+      mpc_codegen_printf(g, "    r->error = mpcg_err_repeat(rs[0].error, \"one or more of \");\n");
+      mpc_codegen_printf(g, "    return 0;\n");
+      mpc_codegen_printf(g, "  }\n");
+      mpc_codegen_printf(g, "  *e = mpcg_err_merge(*e, rs[j].error);\n");
+      mpc_codegen_printf(g, "  r->output = %s(j, (mpc_val_t**)rs);\n", f);
+      mpc_codegen_printf(g, "  if (rs != stk) { free(rs); }\n");
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    case MPC_TYPE_COUNT:
+      g->count = 1;
+      f = mpc_codegen_name(g, mpc_codegen_fold(p->data.repeat.f), "fold function");
+      dx = mpc_codegen_name(g, mpc_codegen_dtor(p->data.repeat.dx), "destructor");
+      mpc_codegen_printf(g, "  mpc_result_t rs[%i];\n", p->data.repeat.n + 1);
+      mpc_codegen_printf(g, "  int j = 0, k;\n");
+      mpc_codegen_printf(g, "  while (j < %i && mpcg_p%i(i, &rs[j], e)) { j++; }\n", p->data.repeat.n, x);
+      mpc_codegen_printf(g, "  if (j == %i) {\n", p->data.repeat.n);
+      mpc_codegen_printf(g, "    r->output = %s(j, (mpc_val_t**)rs);\n", f);
+      mpc_codegen_printf(g, "    return 1;\n");
+      mpc_codegen_printf(g, "  }\n");
+      mpc_codegen_printf(g, "  for (k = 0; k < j; k++) { %s(rs[k].output); }\n", dx);
+      mpc_codegen_printf(g, "  r->error = mpcg_err_count(rs[j].error, %i);\n", p->data.repeat.n);
+      mpc_codegen_printf(g, "  return 0;\n");
+      break;
+    
+    /* Combinatory Parsers */
+    
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        mpc_codegen_printf(g, "  if (mpcg_p%i(i, r, e)) { return 1; }\n", xs[j]);
+        mpc_codegen_printf(g, "  *e = mpcg_err_merge(*e, r->error);\n");
+      }
+      if (p->data.or.n == 0) {
+        mpc_codegen_printf(g, "  (void) i; (void) e;\n");
+        mpc_codegen_printf(g, "  r->output = NULL;\n");
+        mpc_codegen_printf(g, "  return 1;\n");
+      } else {
+        mpc_codegen_printf(g, "  r->error = NULL;\n");
+        mpc_codegen_printf(g, "  return 0;\n");
+      }
+      break;
+    
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) {
+        mpc_codegen_printf(g, "  (void) i; (void) e;\n");
+        mpc_codegen_printf(g, "  r->output = NULL;\n");
+        mpc_codegen_printf(g, "  return 1;\n");
+        break;
+      }
+      f = mpc_codegen_name(g, mpc_codegen_fold(p->data.and.f), "fold function");
+      mpc_codegen_printf(g, "  mpc_result_t rs[%i];\n", p->data.and.n);
+      mpc_codegen_printf(g, "  mpc_state_t s;\n");
+      mpc_codegen_printf(g, "  char l;\n");
+      mpc_codegen_printf(g, "  mpcg_mark(i, &s, &l);\n");
+      for (j = 0; j < p->data.and.n; j++) {
+        mpc_codegen_printf(g, "  if (!mpcg_p%i(i, &rs[%i], e)) {\n", xs[j], j);
+        mpc_codegen_printf(g, "    mpcg_rewind(i, &s, &l);\n");
+        for (x = 0; x < j; x++) {
+          mpc_codegen_printf(g, "    %s(rs[%i].output);\n",
+            mpc_codegen_name(g, mpc_codegen_dtor(p->data.and.dxs[x]), "destructor"), x);
+        }
+        mpc_codegen_printf(g, "    r->error = rs[%i].error;\n", j);
+        mpc_codegen_printf(g, "    return 0;\n");
+        mpc_codegen_printf(g, "  }\n");
+      }
+      mpc_codegen_printf(g, "  r->output = %s(%i, (mpc_val_t**)rs);\n", f, p->data.and.n);
+      mpc_codegen_printf(g, "  return 1;\n");
+      break;
+    
+    default:
+      mpc_codegen_unsupported(g, "unknown parser type");
+      break;
+  }
+  
+  mpc_codegen_printf(g, "}\n");
+  free(xs);
+}
+
+static int mpc_codegen_node(mpc_codegen_t *g, mpc_parser_t *p, int force) {
+  
+  int j, id;
+  
+  if (p->retained && !force) {
+    for (j = 0; j < g->retained_num; j++) {
+      if (g->retained[j] == p) { return g->retained_ids[j]; }
+    }
+  }
+  
+  id = g->nodes_num++;
+  
+  if (p->retained) {
+    g->retained_num++;
+    g->retained = realloc(g->retained, sizeof(mpc_parser_t*) * g->retained_num);
+    g->retained_ids = realloc(g->retained_ids, sizeof(int) * g->retained_num);
+    g->retained[g->retained_num-1] = p;
+    g->retained_ids[g->retained_num-1] = id;
+  }
+  
+  mpc_codegen_body(g, p, id);
+  return id;
+}
+
+static void mpc_codegen_pass(mpc_codegen_t *g, FILE *f, const char *name, mpc_parser_t *p) {
+  
+  int j;
+  
+  g->f = f;
+  g->nodes_num = 0;
+  g->retained_num = 0;
+  
+  for (j = 0; mpc_codegen_prelude[j]; j++) {
+    mpc_codegen_printf(g, "%s\n", mpc_codegen_prelude[j]);
+  }
+  for (j = 0; g->boundary && mpc_codegen_prelude_boundary[j]; j++) {
+    mpc_codegen_printf(g, "%s\n", mpc_codegen_prelude_boundary[j]);
+  }
+  for (j = 0; g->count && mpc_codegen_prelude_count[j]; j++) {
+    mpc_codegen_printf(g, "%s\n", mpc_codegen_prelude_count[j]);
+  }
+  
+  mpc_codegen_printf(g, "\n");
+  for (j = 0; f && j < g->nodes_num_total; j++) {
+    mpc_codegen_printf(g, "static int mpcg_p%i(mpcg_input_t *i, mpc_result_t *r, mpc_err_t **e);\n", j);
+  }
+  
+  mpc_codegen_node(g, p, 1);
+  
+  mpc_codegen_printf(g, "\n");
+  mpc_codegen_printf(g, "int %s_parse(const char *filename, const char *string, mpc_result_t *r) {\n", name);
+  mpc_codegen_printf(g, "  mpc_err_t *e = NULL;\n");
+  mpc_codegen_printf(g, "  mpcg_input_t i;\n");
+  mpc_codegen_printf(g, "  i.filename = filename;\n");
+  mpc_codegen_printf(g, "  i.string = string;\n");
+  mpc_codegen_printf(g, "  i.length = strlen(string);\n");
+  mpc_codegen_printf(g, "  i.backtrack = 1;\n");
+  mpc_codegen_printf(g, "  for (i.suppress = 1; i.suppress >= 0; i.suppress--) {\n");
+  mpc_codegen_printf(g, "    i.state.pos = 0;\n");
+  mpc_codegen_printf(g, "    i.state.row = 0;\n");
+  mpc_codegen_printf(g, "    i.state.col = 0;\n");
+  mpc_codegen_printf(g, "    i.last = '\\0';\n");
+  mpc_codegen_printf(g, "    if (i.suppress == 0) {\n");
+  mpc_codegen_printf(g, "      e = mpcg_err_fail(&i, \"Unknown Error\");\n");
+  mpc_codegen_printf(g, "      e->state.pos = -1;\n");
+  mpc_codegen_printf(g, "      e->state.row = -1;\n");
+  mpc_codegen_printf(g, "      e->state.col = -1;\n");
+  mpc_codegen_printf(g, "    }\n");
+  mpc_codegen_printf(g, "    if (mpcg_p0(&i, r, &e)) {\n");
+  mpc_codegen_printf(g, "      mpcg_err_delete(e);\n");
+  mpc_codegen_printf(g, "      return 1;\n");
+  mpc_codegen_printf(g, "    }\n");
+  mpc_codegen_printf(g, "  }\n");
+  mpc_codegen_printf(g, "  r->error = mpcg_err_merge(e, r->error);\n");
+  mpc_codegen_printf(g, "  return 0;\n");
+  mpc_codegen_printf(g, "}\n");
+}
+
+mpc_err_t *mpc_codegen(FILE *f, const char *name, mpc_parser_t *p) {
+  
+  mpc_codegen_t g;
+  mpc_err_t *err = NULL;
+  
+  g.retained = NULL;
+  g.retained_ids = NULL;
+  g.failure = NULL;
+  g.nodes_num_total = 0;
+  g.boundary = 0;
+  g.count = 0;
+  
+  /* A dry run numbers the nodes and finds anything unsupported */
+  mpc_codegen_pass(&g, NULL, name, p);
+  g.nodes_num_total = g.nodes_num;
+  
+  if (g.failure) {
+    err = mpc_err_file("<mpc_codegen>", g.failure);
+  } else {
+    fprintf(f, "/* Generated by mpc_codegen, do not edit */\n\n");
+    mpc_codegen_pass(&g, f, name, p);
+  }
+  
+  free(g.retained);
+  free(g.retained_ids);
+  free(g.failure);
+  return err;
+}
+
+/*
+** Serialisation
+*/
+
+/*
+** `mpc_serialise` writes the grammar reachable from
+** a list of retained parsers to a flat block of
+** bytes and `mpc_deserialise` defines those parsers
+** again from it. Loading rebuilds the optimised
+** graph node for node, so no grammar or regex text
+** is parsed and no `mpc_optimise` pass is run.
+**
+** The bytes can be saved to a file or compiled in
+** as a C array. Function pointers are stored as
+** indices into a table of the library functions,
+** so as with `mpc_codegen` only grammars using
+** those (such as any built by `mpca_lang`) can be
+** serialised.
+*/
+
+enum {
+  MPC_SERIAL_REF     = 255,
+  MPC_SERIAL_VERSION = 2
+};
+
+enum {
+  MPC_SERIAL_FOLD     = 0,
+  MPC_SERIAL_APPLY    = 1,
+  MPC_SERIAL_APPLY_TO = 2,
+  MPC_SERIAL_CTOR     = 3,
+  MPC_SERIAL_DTOR     = 4,
+  MPC_SERIAL_ANCHOR   = 5
+};
+
+typedef void (*mpc_serial_fn_t)(void);
+
+static const struct { mpc_serial_fn_t f; int kind; } mpc_serial_fns[] = {
+  { (mpc_serial_fn_t)mpcf_null,                MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_fst,                 MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_snd,                 MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_trd,                 MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_fst_free,            MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_snd_free,            MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_trd_free,            MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_strfold,             MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_maths,               MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_fold_ast,            MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_state_ast,           MPC_SERIAL_FOLD },
+  { (mpc_serial_fn_t)mpcf_free,                MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_int,                 MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_hex,                 MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_oct,                 MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_float,               MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_strtriml,            MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_strtrimr,            MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_strtrim,             MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_escape,              MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_escape_regex,        MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_escape_string_raw,   MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_escape_char_raw,     MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_unescape,            MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_unescape_regex,      MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_unescape_string_raw, MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_unescape_char_raw,   MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpcf_str_ast,             MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpc_ast_add_root,         MPC_SERIAL_APPLY },
+  { (mpc_serial_fn_t)mpc_ast_tag,              MPC_SERIAL_APPLY_TO },
+  { (mpc_serial_fn_t)mpc_ast_add_tag,          MPC_SERIAL_APPLY_TO },
+  { (mpc_serial_fn_t)mpcf_ctor_null,           MPC_SERIAL_CTOR },
+  { (mpc_serial_fn_t)mpcf_ctor_str,            MPC_SERIAL_CTOR },
+  { (mpc_serial_fn_t)free,                     MPC_SERIAL_DTOR },
+  { (mpc_serial_fn_t)mpcf_dtor_null,           MPC_SERIAL_DTOR },
+  { (mpc_serial_fn_t)mpc_ast_delete,           MPC_SERIAL_DTOR },
+  { (mpc_serial_fn_t)mpc_delete,               MPC_SERIAL_DTOR },
+  { (mpc_serial_fn_t)mpc_soi_anchor,           MPC_SERIAL_ANCHOR },
+  { (mpc_serial_fn_t)mpc_eoi_anchor,           MPC_SERIAL_ANCHOR },
+  { (mpc_serial_fn_t)mpc_boundary_anchor,      MPC_SERIAL_ANCHOR },
+  { NULL, 0 }
+};
+
+/* Tags given as string literals by `mpca_lang` */
+static const char *mpc_serial_tags[] = { "string", "char", "regex", NULL };
+
+typedef struct {
+  unsigned char *data;
+  size_t len;
+  size_t slots;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  char *failure;
+} mpc_serial_t;
+
+static void mpc_serial_failure(mpc_serial_t *s, const char *what) {
+  if (s->failure) { return; }
+  s->failure = malloc(strlen(what) + 64);
+  sprintf(s->failure, "Cannot serialise %s!", what);
+}
+
+static void mpc_serial_byte(mpc_serial_t *s, int x) {
+  if (s->len == s->slots) {
+    s->slots = s->slots ? s->slots * 2 : 256;
+    s->data = realloc(s->data, s->slots);
+  }
+  s->data[s->len++] = (unsigned char)x;
+}
+
+static void mpc_serial_int(mpc_serial_t *s, int x) {
+  mpc_serial_byte(s, x >>  0 & 0xFF);
+  mpc_serial_byte(s, x >>  8 & 0xFF);
+  mpc_serial_byte(s, x >> 16 & 0xFF);
+  mpc_serial_byte(s, x >> 24 & 0xFF);
+}
+
+static void mpc_serial_string(mpc_serial_t *s, const char *x) {
+  int n = (int)strlen(x);
+  mpc_serial_int(s, n);
+  while (*x) { mpc_serial_byte(s, *x++); }
+}
+
+static void mpc_serial_fn(mpc_serial_t *s, mpc_serial_fn_t f, int kind, const char *what) {
+  int j;
+  for (j = 0; mpc_serial_fns[j].f; j++) {
+    if (mpc_serial_fns[j].f == f && mpc_serial_fns[j].kind == kind) {
+      mpc_serial_byte(s, j);
+      return;
+    }
+  }
+  mpc_serial_failure(s, what);
+  mpc_serial_byte(s, 0);
+}
+
+static void mpc_serial_node(mpc_serial_t *s, mpc_parser_t *p, int force) {
+  
+  int j;
+  
+  if (p->retained && !force) {
+    for (j = 0; j < s->parsers_num; j++) {
+      if (s->parsers[j] == p) {
+        mpc_serial_byte(s, MPC_SERIAL_REF);
+        mpc_serial_int(s, j);
+        return;
+      }
+    }
+    mpc_serial_failure(s, p->name ? p->name : "unlisted retained parser");
+    return;
+  }
+  
+  mpc_serial_byte(s, p->type);
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: mpc_serial_string(s, p->data.fail.m); break;
+    
+    case MPC_TYPE_LIFT:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.lift.lf, MPC_SERIAL_CTOR, "lift function");
+      break;
+    
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x) { mpc_serial_failure(s, "lifted value"); }
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_serial_string(s, p->data.expect.m);
+      mpc_serial_node(s, p->data.expect.x, 0);
+      break;
+    
+    case MPC_TYPE_ANCHOR:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.anchor.f, MPC_SERIAL_ANCHOR, "anchor function");
+      break;
+    
+    case MPC_TYPE_SINGLE: mpc_serial_byte(s, p->data.single.x); break;
+    case MPC_TYPE_RANGE:
+      mpc_serial_byte(s, p->data.range.x);
+      mpc_serial_byte(s, p->data.range.y);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      mpc_serial_string(s, p->data.string.x);
+      break;
+    
+    case MPC_TYPE_SATISFY: mpc_serial_failure(s, "satisfy function"); break;
+    
+    case MPC_TYPE_APPLY:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.apply.f, MPC_SERIAL_APPLY, "apply function");
+      mpc_serial_node(s, p->data.apply.x, 0);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.apply_to.f, MPC_SERIAL_APPLY_TO, "apply_to function");
+      mpc_serial_string(s, s->failure ? "" : p->data.apply_to.d);
+      mpc_serial_node(s, p->data.apply_to.x, 0);
+      break;
+    
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      mpc_serial_failure(s, "check function");
+      break;
+    
+    case MPC_TYPE_PREDICT: mpc_serial_node(s, p->data.predict.x, 0); break;
+    
+    case MPC_TYPE_NOT:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.not.dx, MPC_SERIAL_DTOR, "destructor");
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.not.lf, MPC_SERIAL_CTOR, "lift function");
+      mpc_serial_node(s, p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.not.lf, MPC_SERIAL_CTOR, "lift function");
+      mpc_serial_node(s, p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.repeat.f, MPC_SERIAL_FOLD, "fold function");
+      mpc_serial_node(s, p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_COUNT:
+      mpc_serial_int(s, p->data.repeat.n);
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.repeat.f, MPC_SERIAL_FOLD, "fold function");
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.repeat.dx, MPC_SERIAL_DTOR, "destructor");
+      mpc_serial_node(s, p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_OR:
+      mpc_serial_int(s, p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) { mpc_serial_node(s, p->data.or.xs[j], 0); }
+      break;
+    
+    case MPC_TYPE_AND:
+      mpc_serial_int(s, p->data.and.n);
+      mpc_serial_fn(s, (mpc_serial_fn_t)p->data.and.f, MPC_SERIAL_FOLD, "fold function");
+      for (j = 0; j < p->data.and.n-1; j++) {
+        mpc_serial_fn(s, (mpc_serial_fn_t)p->data.and.dxs[j], MPC_SERIAL_DTOR, "destructor");
+      }
+      for (j = 0; j < p->data.and.n; j++) { mpc_serial_node(s, p->data.and.xs[j], 0); }
+      break;
+    
+    case MPC_TYPE_CHARSET:
+      for (j = 0; j < 32; j++) { mpc_serial_byte(s, p->data.charset.x[j]); }
+      mpc_serial_int(s, p->data.charset.n);
+      for (j = 0; j < p->data.charset.n; j++) { mpc_serial_string(s, p->data.charset.ms[j]); }
+      break;
+    
+    default: break;
+  }
+  
+}
+
+mpc_err_t *mpc_serialise(unsigned char **data, size_t *len, int n, ...) {
+  
+  int j;
+  va_list va;
+  mpc_serial_t s;
+  mpc_err_t *err = NULL;
+  
+  s.data = NULL;
+  s.len = 0;
+  s.slots = 0;
+  s.parsers_num = n;
+  s.parsers = malloc(sizeof(mpc_parser_t*) * n);
+  s.failure = NULL;
+  
+  va_start(va, n);
+  for (j = 0; j < n; j++) { s.parsers[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+  
+  mpc_serial_byte(&s, 'M');
+  mpc_serial_byte(&s, 'P');
+  mpc_serial_byte(&s, 'C');
+  mpc_serial_byte(&s, MPC_SERIAL_VERSION);
+  mpc_serial_int(&s, n);
+  for (j = 0; j < n; j++) {
+    mpc_serial_string(&s, s.parsers[j]->name ? s.parsers[j]->name : "");
+  }
+  for (j = 0; j < n; j++) {
+    if (!s.parsers[j]->retained) { mpc_serial_failure(&s, "unretained parser"); break; }
+    mpc_serial_node(&s, s.parsers[j], 1);
+  }
+  
+  if (s.failure) {
+    err = mpc_err_file("<mpc_serialise>", s.failure);
+    free(s.data);
+    *data = NULL;
+    *len = 0;
+  } else {
+    *data = s.data;
+    *len = s.len;
+  }
+  
+  free(s.parsers);
+  free(s.failure);
+  return err;
+}
+
+typedef struct {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  int invalid;
+  int depth;
+} mpc_unserial_t;
+
+static int mpc_unserial_byte(mpc_unserial_t *s) {
+  if (s->pos >= s->len) { s->invalid = 1; return 0; }
+  return s->data[s->pos++];
+}
+
+static int mpc_unserial_int(mpc_unserial_t *s) {
+  unsigned int x = 0;
+  x |= (unsigned int)mpc_unserial_byte(s) <<  0;
+  x |= (unsigned int)mpc_unserial_byte(s) <<  8;
+  x |= (unsigned int)mpc_unserial_byte(s) << 16;
+  x |= (unsigned int)mpc_unserial_byte(s) << 24;
+  if (x > 0x7FFFFFFF) { s->invalid = 1; return 0; }
+  return (int)x;
+}
+
+static char *mpc_unserial_string(mpc_unserial_t *s) {
+  int n = mpc_unserial_int(s);
+  char *x;
+  if (s->invalid || (size_t)n > s->len - s->pos) { s->invalid = 1; return calloc(1, 1); }
+  x = malloc(n + 1);
+  memcpy(x, s->data + s->pos, n);
+  x[n] = '\0';
+  s->pos += n;
+  return x;
+}
+
+static mpc_serial_fn_t mpc_unserial_fn(mpc_unserial_t *s, int kind) {
+  int j = mpc_unserial_byte(s);
+  if (j >= (int)(sizeof(mpc_serial_fns) / sizeof(mpc_serial_fns[0])) - 1
+  ||  mpc_serial_fns[j].kind != kind) {
+    s->invalid = 1;
+    return NULL;
+  }
+  return mpc_serial_fns[j].f;
+}
+
+/* `apply_to` data is not owned by the parser, so tags point at strings that outlive it */
+static void *mpc_unserial_tag(mpc_unserial_t *s) {
+  int j;
+  char *x = mpc_unserial_string(s);
+  const char *t = NULL;
+  for (j = 0; mpc_serial_tags[j]; j++) {
+    if (strcmp(mpc_serial_tags[j], x) == 0) { t = mpc_serial_tags[j]; }
+  }
+  for (j = 0; j < s->parsers_num; j++) {
+    if (s->parsers[j]->name && strcmp(s->parsers[j]->name, x) == 0) { t = s->parsers[j]->name; }
+  }
+  if (t == NULL) { s->invalid = 1; }
+  free(x);
+  return (void*)t;
+}
+
+static mpc_parser_t *mpc_unserial_node(mpc_unserial_t *s) {
+  
+  int j, type;
+  mpc_parser_t *p;
+  
+  type = mpc_unserial_byte(s);
+  
+  if (type == MPC_SERIAL_REF) {
+    j = mpc_unserial_int(s);
+    if (j < s->parsers_num) { return s->parsers[j]; }
+    s->invalid = 1;
+    return mpc_pass();
+  }
+  
+  if (type > MPC_TYPE_CHARSET || s->invalid || s->depth > 4096) {
+    s->invalid = 1;
+    return mpc_pass();
+  }
+  
+  s->depth++;
+  p = mpc_undefined();
+  p->type = type;
+  
+  switch (type) {
+    
+    case MPC_TYPE_FAIL: p->data.fail.m = mpc_unserial_string(s); break;
+    case MPC_TYPE_LIFT: p->data.lift.lf = (mpc_ctor_t)mpc_unserial_fn(s, MPC_SERIAL_CTOR); break;
+    
+    case MPC_TYPE_EXPECT:
+      p->data.expect.m = mpc_unserial_string(s);
+      p->data.expect.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_ANCHOR:
+      p->data.anchor.f = (int(*)(char,char))mpc_unserial_fn(s, MPC_SERIAL_ANCHOR);
+      break;
+    
+    case MPC_TYPE_SINGLE: p->data.single.x = (char)mpc_unserial_byte(s); break;
+    case MPC_TYPE_RANGE:
+      p->data.range.x = (char)mpc_unserial_byte(s);
+      p->data.range.y = (char)mpc_unserial_byte(s);
+      break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      p->data.string.x = mpc_unserial_string(s);
+      break;
+    
+    case MPC_TYPE_APPLY:
+      p->data.apply.f = (mpc_apply_t)mpc_unserial_fn(s, MPC_SERIAL_APPLY);
+      p->data.apply.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_APPLY_TO:
+      p->data.apply_to.f = (mpc_apply_to_t)mpc_unserial_fn(s, MPC_SERIAL_APPLY_TO);
+      p->data.apply_to.d = mpc_unserial_tag(s);
+      p->data.apply_to.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_PREDICT: p->data.predict.x = mpc_unserial_node(s); break;
+    
+    case MPC_TYPE_NOT:
+      p->data.not.dx = (mpc_dtor_t)mpc_unserial_fn(s, MPC_SERIAL_DTOR);
+      p->data.not.lf = (mpc_ctor_t)mpc_unserial_fn(s, MPC_SERIAL_CTOR);
+      p->data.not.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+      p->data.not.lf = (mpc_ctor_t)mpc_unserial_fn(s, MPC_SERIAL_CTOR);
+      p->data.not.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      p->data.repeat.f = (mpc_fold_t)mpc_unserial_fn(s, MPC_SERIAL_FOLD);
+      p->data.repeat.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_COUNT:
+      p->data.repeat.n = mpc_unserial_int(s);
+      p->data.repeat.f = (mpc_fold_t)mpc_unserial_fn(s, MPC_SERIAL_FOLD);
+      p->data.repeat.dx = (mpc_dtor_t)mpc_unserial_fn(s, MPC_SERIAL_DTOR);
+      p->data.repeat.x = mpc_unserial_node(s);
+      break;
+    
+    case MPC_TYPE_OR:
+      p->data.or.n = mpc_unserial_int(s);
+      if ((size_t)p->data.or.n > s->len - s->pos) { s->invalid = 1; p->data.or.n = 0; }
+      p->data.or.xs = malloc(sizeof(mpc_parser_t*) * p->data.or.n);
+      for (j = 0; j < p->data.or.n; j++) { p->data.or.xs[j] = mpc_unserial_node(s); }
+      p->data.or.trie = mpc_trie_new(p);
+      break;
+    
+    case MPC_TYPE_AND:
+      p->data.and.n = mpc_unserial_int(s);
+      if (p->data.and.n < 1 || (size_t)p->data.and.n > s->len - s->pos) { s->invalid = 1; p->data.and.n = 1; }
+      p->data.and.f = (mpc_fold_t)mpc_unserial_fn(s, MPC_SERIAL_FOLD);
+      p->data.and.xs = malloc(sizeof(mpc_parser_t*) * p->data.and.n);
+      p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (p->data.and.n-1));
+      for (j = 0; j < p->data.and.n-1; j++) {
+        p->data.and.dxs[j] = (mpc_dtor_t)mpc_unserial_fn(s, MPC_SERIAL_DTOR);
+      }
+      for (j = 0; j < p->data.and.n; j++) { p->data.and.xs[j] = mpc_unserial_node(s); }
+      break;
+    
+    case MPC_TYPE_CHARSET:
+      p->data.charset.x = malloc(32);
+      for (j = 0; j < 32; j++) { p->data.charset.x[j] = (unsigned char)mpc_unserial_byte(s); }
+      p->data.charset.n = mpc_unserial_int(s);
+      if ((size_t)p->data.charset.n > s->len - s->pos) { s->invalid = 1; p->data.charset.n = 0; }
+      p->data.charset.ms = malloc(sizeof(char*) * p->data.charset.n);
+      for (j = 0; j < p->data.charset.n; j++) { p->data.charset.ms[j] = mpc_unserial_string(s); }
+      break;
+    
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_CHECK:
+    case MPC_TYPE_CHECK_WITH:
+      s->invalid = 1;
+      p->type = MPC_TYPE_PASS;
+      break;
+    
+    default: break;
+  }
+  
+  s->depth--;
+  return p;
+}
+
+mpc_err_t *mpc_deserialise(const unsigned char *data, size_t len, int n, ...) {
+  
+  int j;
+  char *name;
+  va_list va;
+  mpc_unserial_t s;
+  mpc_parser_t **defs;
+  
+  s.data = data;
+  s.len = len;
+  s.pos = 0;
+  s.invalid = 0;
+  s.depth = 0;
+  
+  if (len < 8 || memcmp(data, "MPC", 3) != 0 || data[3] != MPC_SERIAL_VERSION) {
+    return mpc_err_file("<mpc_deserialise>", "Invalid grammar data!");
+  }
+  
+  s.pos = 4;
+  if (mpc_unserial_int(&s) != n) {
+    return mpc_err_file("<mpc_deserialise>", "Grammar data is for a different number of parsers!");
+  }
+  
+  s.parsers_num = n;
+  s.parsers = malloc(sizeof(mpc_parser_t*) * n);
+  
+  va_start(va, n);
+  for (j = 0; j < n; j++) { s.parsers[j] = va_arg(va, mpc_parser_t*); }
+  va_end(va);
+  
+  for (j = 0; j < n; j++) {
+    name = mpc_unserial_string(&s);
+    if (strcmp(name, s.parsers[j]->name ? s.parsers[j]->name : "") != 0) { s.invalid = 1; }
+    free(name);
+  }
+  
+  /* Nothing is defined until all of the data has been read */
+  defs = calloc(n, sizeof(mpc_parser_t*));
+  for (j = 0; j < n && !s.invalid; j++) {
+    defs[j] = mpc_unserial_node(&s);
+  }
+  
+  if (s.invalid || s.pos != s.len) {
+    for (j = 0; j < n; j++) {
+      if (defs[j]) { mpc_soft_delete(defs[j]); }
+    }
+    free(defs);
+    free(s.parsers);
+    return mpc_err_file("<mpc_deserialise>", "Invalid grammar data!");
+  }
+  
+  for (j = 0; j < n; j++) {
+    mpc_undefine(s.parsers[j]);
+    mpc_define(s.parsers[j], defs[j]);
+  }
+  
+  free(defs);
+  free(s.parsers);
+  return NULL;
+}
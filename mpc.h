@@ -73,6 +73,17 @@ extern "C"
   int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
   int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+  typedef struct
+  {
+    void (*enter)(void *d, const char *rule, mpc_state_t s);
+    void (*token)(void *d, const char *tag, const char *contents, mpc_state_t s);
+    void (*leave)(void *d, const char *rule);
+  } mpc_events_t;
+
+  int mpc_parse_events(const char *filename, const char *string, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r);
+  int mpc_parse_events_file(const char *filename, FILE *file, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r);
+  int mpc_parse_events_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, const mpc_events_t *ev, void *d, mpc_result_t *r);
+
   /*
 ** Function Types
 */
@@ -319,6 +330,44 @@ extern "C"
 
   void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+  /*
+** Walks a tree without allocating per node. Frames are
+** kept in `buf` (which may be NULL) and moved to the heap
+** only if it fills up. It has its own order type, as level
+** order is not something `mpc_ast_traverse_start` can do.
+*/
+
+  typedef enum
+  {
+    mpc_ast_walk_order_pre,
+    mpc_ast_walk_order_post,
+    mpc_ast_walk_order_level
+  } mpc_ast_walk_order_t;
+
+  typedef struct
+  {
+    mpc_ast_t *node;
+    int child;
+  } mpc_ast_walk_frame_t;
+
+  typedef struct
+  {
+    mpc_ast_walk_order_t order;
+    mpc_ast_walk_frame_t *frames;
+    int head;
+    int frames_num;
+    int frames_slots;
+    int owned;
+  } mpc_ast_walk_t;
+
+  void mpc_ast_walk_start(mpc_ast_walk_t *w, mpc_ast_t *ast,
+                          mpc_ast_walk_order_t order,
+                          mpc_ast_walk_frame_t *buf, int buf_num);
+
+  mpc_ast_t *mpc_ast_walk_next(mpc_ast_walk_t *w);
+
+  void mpc_ast_walk_free(mpc_ast_walk_t *w);
+
   /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
@@ -365,6 +414,12 @@ extern "C"
   void mpc_print(mpc_parser_t *p);
   void mpc_optimise(mpc_parser_t *p);
   void mpc_stats(mpc_parser_t *p);
+  int mpc_analyse(mpc_parser_t *p, FILE *f);
+
+  mpc_err_t *mpc_codegen(FILE *f, const char *name, mpc_parser_t *p);
+
+  mpc_err_t *mpc_serialise(unsigned char **data, size_t *len, int n, ...);
+  mpc_err_t *mpc_deserialise(const unsigned char *data, size_t len, int n, ...);
 
   int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
                     int (*tester)(const void *, const void *),
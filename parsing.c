@@ -1,7 +1,21 @@
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && \
+    (defined(__GNUC__) || defined(__clang__)) && !defined(CLISP_NO_JIT)
+#define CLISP_JIT
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include "mpc.h"
 
+#ifdef CLISP_JIT
+#include <sys/mman.h>
+#include <cpuid.h>
+#endif
+
+#ifndef CLISP_NO_MAIN
 #ifdef _WIN32
 #include <string.h>
 
@@ -10,7 +24,10 @@ static char buffer[2048];
 char *readline(char *prompt)
 {
     fputs(prompt, stdout);
-    fgets(buffer, 2048, stdin);
+    if (fgets(buffer, 2048, stdin) == NULL)
+    {
+        return NULL;
+    }
     char *cpy = malloc(strlen(buffer) + 1);
     strcpy(cpy, buffer);
     cpy[strlen(cpy) - 1] = '\0';
@@ -21,26 +38,191 @@ char *readline(char *prompt)
 #include <editline/readline.h>
 #include <editline/history.h>
 #endif
+#endif
+
+struct lval;
+typedef struct lval *(*lbuiltin)(struct lval *, struct lval *);
 
 typedef struct lval
 {
     int type;
+    int ref;
+    int mark;
+    int consed;
+    unsigned long hash;
+    struct lval *next;
     double dbl;
     long lng;
     char *err;
     char *sym;
+    struct bignum *big;
     int count;
     struct lval **cell;
+    int vtype;
+    long *lngs;
+    double *dbls;
+    struct lbuf *buf;
+    int off;
+    struct scope *scope;
+    int epoch;
+    int depth;
+    int slot;
+    lbuiltin fun;
+    struct lval *formals;
+    struct lval *body;
+    struct lval *env;
+    struct bcode *code;
 } lval;
 
+// list storage shared between values. a list is the view [off, off + count)
+// of a refcounted buffer owning the items in [lo, hi), so slicing is O(1)
+// and cons or append can claim free slots either side of the items.
+typedef struct lbuf
+{
+    int ref;
+    int size;
+    int boxed;
+    int lo;
+    int hi;
+    int cap;
+    char *data;
+} lbuf;
+
+// lexical scopes are resolved ahead of evaluation. a scope names the slots
+// of one lambda's frames, the global scope also keeps a hash index. a
+// symbol caches the (depth, slot) it resolved to along with the innermost
+// scope it was resolved from, so a lookup is one pointer compare and an
+// indexed load. a mismatch simply resolves the name again.
+typedef struct scope
+{
+    int ref;
+    struct scope *parent;
+    int count;
+    int cap;
+    char **names;
+    int *index;
+    int index_cap;
+} scope;
+
+scope *global_scope = NULL;
+
+// bumped whenever a local scope grows at run time, voiding cached lookups
+int scope_epoch = 0;
+
+scope *scope_new(scope *parent)
+{
+    scope *s = calloc(1, sizeof(scope));
+    s->ref = 1;
+    s->parent = parent;
+    if (parent)
+    {
+        parent->ref++;
+    }
+    return s;
+}
+
+void scope_release(scope *s)
+{
+    while (s && --s->ref == 0)
+    {
+        scope *parent = s->parent;
+        for (int i = 0; i < s->count; i++)
+        {
+            free(s->names[i]);
+        }
+        free(s->names);
+        free(s->index);
+        free(s);
+        s = parent;
+    }
+}
+
+unsigned long str_hash(const char *s)
+{
+    unsigned long h = 2166136261u;
+    while (*s)
+    {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+void scope_index(scope *s, int slot)
+{
+    int mask = s->index_cap - 1;
+    int i = str_hash(s->names[slot]) & mask;
+    while (s->index[i])
+    {
+        i = (i + 1) & mask;
+    }
+    s->index[i] = slot + 1;
+}
+
+int scope_find(scope *s, const char *name)
+{
+    if (s->index)
+    {
+        int mask = s->index_cap - 1;
+        for (int i = str_hash(name) & mask; s->index[i]; i = (i + 1) & mask)
+        {
+            if (strcmp(s->names[s->index[i] - 1], name) == 0)
+            {
+                return s->index[i] - 1;
+            }
+        }
+        return -1;
+    }
+
+    for (int i = 0; i < s->count; i++)
+    {
+        if (strcmp(s->names[i], name) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int scope_add(scope *s, const char *name)
+{
+    if (s->count == s->cap)
+    {
+        s->cap = s->cap ? s->cap * 2 : 4;
+        s->names = realloc(s->names, sizeof(char *) * s->cap);
+    }
+    s->names[s->count] = malloc(strlen(name) + 1);
+    strcpy(s->names[s->count], name);
+
+    if (s->index && (s->count + 1) * 2 > s->index_cap)
+    {
+        s->index_cap *= 2;
+        s->index = realloc(s->index, sizeof(int) * s->index_cap);
+        memset(s->index, 0, sizeof(int) * s->index_cap);
+        for (int i = 0; i < s->count; i++)
+        {
+            scope_index(s, i);
+        }
+    }
+    if (s->index)
+    {
+        scope_index(s, s->count);
+    }
+    return s->count++;
+}
+
 enum
 {
     LVAL_DOUBLE,
     LVAL_LONG,
+    LVAL_BIGNUM,
     LVAL_SYM,
     LVAL_SEXPR,
     LVAL_QEXPR,
-    LVAL_ERR
+    LVAL_VECTOR,
+    LVAL_FUN,
+    LVAL_ENV,
+    LVAL_ERR,
+    LVAL_FREE
 };
 
 enum
@@ -50,601 +232,5281 @@ enum
     LERR_BAD_NUM
 };
 
-lval *lval_long(long x)
+// overflow checked long arithmetic, the builtins compile to a single jo
+#if defined(__GNUC__) || defined(__clang__)
+#define long_add_overflow(x, y, r) __builtin_add_overflow(x, y, r)
+#define long_sub_overflow(x, y, r) __builtin_sub_overflow(x, y, r)
+#define long_mul_overflow(x, y, r) __builtin_mul_overflow(x, y, r)
+#else
+int long_add_overflow(long x, long y, long *r)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_LONG;
-    v->lng = x;
-    return v;
+    if ((y > 0 && x > LONG_MAX - y) || (y < 0 && x < LONG_MIN - y))
+    {
+        return 1;
+    }
+    *r = x + y;
+    return 0;
 }
 
-lval *lval_double(double x)
+int long_sub_overflow(long x, long y, long *r)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_DOUBLE;
-    v->dbl = x;
-    return v;
+    if ((y < 0 && x > LONG_MAX + y) || (y > 0 && x < LONG_MIN + y))
+    {
+        return 1;
+    }
+    *r = x - y;
+    return 0;
 }
 
-lval *lval_err(char *m)
+int long_mul_overflow(long x, long y, long *r)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
-    v->err = malloc(strlen(m) + 1);
-    strcpy(v->err, m);
-    return v;
+    if (x > 0 ? (y > 0 ? x > LONG_MAX / y : y < LONG_MIN / x)
+              : (y > 0 ? x < LONG_MIN / y : (x != 0 && y < LONG_MAX / x)))
+    {
+        return 1;
+    }
+    *r = x * y;
+    return 0;
 }
+#endif
 
-lval *lval_sym(char *s)
+// arbitrary precision integer, magnitude is little endian base 2^32 limbs
+typedef struct bignum
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
-}
+    int sign;
+    int count;
+    uint32_t *limbs;
+} bignum;
 
-lval *lval_sexpr(void)
+// below this many limbs schoolbook multiplication beats karatsuba
+#define KARATSUBA_CUTOFF 32
+
+bignum *big_new(int count)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    bignum *b = malloc(sizeof(bignum));
+    b->sign = 0;
+    b->count = count;
+    b->limbs = calloc(count > 0 ? count : 1, sizeof(uint32_t));
+    return b;
 }
 
-lval *lval_qexpr(void)
+void big_del(bignum *b)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    free(b->limbs);
+    free(b);
 }
 
-void lval_del(lval *v)
+bignum *big_trim(bignum *b)
 {
-    switch (v->type)
+    while (b->count > 0 && b->limbs[b->count - 1] == 0)
     {
-    case LVAL_DOUBLE:
-        break;
-    case LVAL_LONG:
-        break;
-    case LVAL_ERR:
-        free(v->err);
-        break;
-    case LVAL_SYM:
-        free(v->sym);
-        break;
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-        for (int i = 0; i < v->count; i++)
-        {
-            lval_del(v->cell[i]);
-        }
-        free(v->cell);
-        break;
+        b->count--;
     }
-
-    free(v);
+    if (b->count == 0)
+    {
+        b->sign = 0;
+    }
+    return b;
 }
 
-lval *lval_read_long(mpc_ast_t *t)
+bignum *big_copy(bignum *b, int count)
 {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_long(x) : lval_err("invalid long");
+    bignum *c = big_new(count > b->count ? count : b->count);
+    memcpy(c->limbs, b->limbs, sizeof(uint32_t) * b->count);
+    c->sign = b->sign;
+    return c;
 }
 
-lval *lval_read_double(mpc_ast_t *t)
+bignum *big_from_long(long x)
 {
-    errno = 0;
-    double x = strtod(t->contents, NULL);
-    return errno != ERANGE ? lval_double(x) : lval_err("invalid double");
+    bignum *b = big_new(2);
+    uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    b->sign = x < 0 ? -1 : x > 0;
+    b->limbs[0] = (uint32_t)m;
+    b->limbs[1] = (uint32_t)(m >> 32);
+    return big_trim(b);
 }
 
-lval *lval_add(lval *v, lval *x)
+int big_to_long(bignum *b, long *x)
 {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    v->cell[v->count - 1] = x;
-    return v;
-}
+    if (b->count > 2)
+    {
+        return 0;
+    }
 
-lval *lval_read(mpc_ast_t *t)
-{
-    if (strstr(t->tag, "double"))
+    uint64_t m = 0;
+    for (int i = b->count - 1; i >= 0; i--)
     {
-        return lval_read_double(t);
+        m = (m << 32) | b->limbs[i];
     }
-    if (strstr(t->tag, "long"))
+
+    if (b->sign >= 0)
     {
-        return lval_read_long(t);
+        if (m > (uint64_t)LONG_MAX)
+        {
+            return 0;
+        }
+        *x = (long)m;
+        return 1;
     }
-    if (strstr(t->tag, "symbol"))
+
+    if (m > (uint64_t)LONG_MAX + 1)
     {
-        return lval_sym(t->contents);
+        return 0;
     }
+    *x = m == (uint64_t)LONG_MAX + 1 ? LONG_MIN : -(long)m;
+    return 1;
+}
 
-    lval *x = NULL;
-    if (strcmp(t->tag, ">") == 0)
+double big_to_double(bignum *b)
+{
+    double d = 0;
+    for (int i = b->count - 1; i >= 0; i--)
     {
-        x = lval_sexpr();
+        d = d * 4294967296.0 + b->limbs[i];
     }
-    if (strstr(t->tag, "sexpr"))
+    return b->sign < 0 ? -d : d;
+}
+
+int mag_cmp(const uint32_t *a, int an, const uint32_t *b, int bn)
+{
+    while (an > 0 && a[an - 1] == 0)
     {
-        x = lval_sexpr();
+        an--;
     }
-    if (strstr(t->tag, "qexpr"))
+    while (bn > 0 && b[bn - 1] == 0)
     {
-        x = lval_qexpr();
+        bn--;
     }
-
-    for (int i = 0; i < t->children_num; i++)
+    if (an != bn)
     {
-        if (strcmp(t->children[i]->contents, "(") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, ")") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "}") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->contents, "{") == 0)
-        {
-            continue;
-        }
-        if (strcmp(t->children[i]->tag, "regex") == 0)
+        return an > bn ? 1 : -1;
+    }
+    for (int i = an - 1; i >= 0; i--)
+    {
+        if (a[i] != b[i])
         {
-            continue;
+            return a[i] > b[i] ? 1 : -1;
         }
-        x = lval_add(x, lval_read(t->children[i]));
     }
-
-    return x;
+    return 0;
 }
 
-void lval_print(lval *v);
-
-void lval_expr_print(lval *v, char open, char close)
+// r += a, r must be wide enough to hold the carry
+void mag_add_to(uint32_t *r, int rn, const uint32_t *a, int an)
 {
-    putchar(open);
-    for (int i = 0; i < v->count; i++)
+    uint64_t carry = 0;
+    int i = 0;
+    for (; i < an; i++)
     {
-        lval_print(v->cell[i]);
-
-        if (i != (v->count - 1))
-        {
-            putchar(' ');
-        }
+        carry += (uint64_t)r[i] + a[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (; carry && i < rn; i++)
+    {
+        carry += r[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
     }
-    putchar(close);
 }
 
-void lval_print(lval *v)
+// r -= a, requires r >= a
+void mag_sub_from(uint32_t *r, int rn, const uint32_t *a, int an)
 {
-    switch (v->type)
+    int64_t borrow = 0;
+    int i = 0;
+    for (; i < an; i++)
     {
-    case LVAL_LONG:
-        printf("%li", v->lng);
-        break;
-    case LVAL_DOUBLE:
-        printf("%f", v->dbl);
-        break;
-    case LVAL_ERR:
-        printf("error: %s", v->err);
-        break;
-    case LVAL_SYM:
-        printf("%s", v->sym);
-        break;
-    case LVAL_SEXPR:
-        lval_expr_print(v, '(', ')');
-        break;
-    case LVAL_QEXPR:
-        lval_expr_print(v, '{', '}');
-        break;
+        int64_t d = (int64_t)r[i] - a[i] - borrow;
+        borrow = d < 0;
+        r[i] = (uint32_t)d;
+    }
+    for (; borrow && i < rn; i++)
+    {
+        int64_t d = (int64_t)r[i] - borrow;
+        borrow = d < 0;
+        r[i] = (uint32_t)d;
     }
 }
 
-void lval_println(lval *v)
+// r must hold an + bn zeroed limbs
+void mag_mul(const uint32_t *a, int an, const uint32_t *b, int bn, uint32_t *r)
 {
-    lval_print(v);
-    putchar('\n');
-}
+    if (an < KARATSUBA_CUTOFF || bn < KARATSUBA_CUTOFF)
+    {
+        for (int i = 0; i < an; i++)
+        {
+            uint64_t carry = 0;
+            for (int j = 0; j < bn; j++)
+            {
+                carry += (uint64_t)a[i] * b[j] + r[i + j];
+                r[i + j] = (uint32_t)carry;
+                carry >>= 32;
+            }
+            r[i + bn] = (uint32_t)carry;
+        }
+        return;
+    }
 
-lval *eval_longs(long x, char *op, long y)
-{
-    if (strcmp(op, "+") == 0)
+    // karatsuba: a = a1 B^m + a0, b = b1 B^m + b0
+    int m = (an < bn ? an : bn) / 2;
+    int a1n = an - m;
+    int b1n = bn - m;
+
+    // z0 and z2 land directly in the low and high halves of r
+    mag_mul(a, m, b, m, r);
+    mag_mul(a + m, a1n, b + m, b1n, r + 2 * m);
+
+    // z1 = (a0 + a1)(b0 + b1) - z0 - z2
+    uint32_t *sa = calloc(a1n + 1, sizeof(uint32_t));
+    uint32_t *sb = calloc(b1n + 1, sizeof(uint32_t));
+    memcpy(sa, a + m, sizeof(uint32_t) * a1n);
+    memcpy(sb, b + m, sizeof(uint32_t) * b1n);
+    mag_add_to(sa, a1n + 1, a, m);
+    mag_add_to(sb, b1n + 1, b, m);
+
+    int zn = a1n + b1n + 2;
+    uint32_t *z1 = calloc(zn, sizeof(uint32_t));
+    mag_mul(sa, a1n + 1, sb, b1n + 1, z1);
+    mag_sub_from(z1, zn, r, 2 * m);
+    mag_sub_from(z1, zn, r + 2 * m, a1n + b1n);
+
+    while (zn > 0 && z1[zn - 1] == 0)
     {
-        return lval_long(x + y);
+        zn--;
     }
-    if (strcmp(op, "-") == 0)
+    mag_add_to(r + m, an + bn - m, z1, zn);
+
+    free(sa);
+    free(sb);
+    free(z1);
+}
+
+int nlz32(uint32_t x)
+{
+    int n = 0;
+    if (x == 0)
     {
-        return lval_long(x - y);
+        return 32;
     }
-    if (strcmp(op, "*") == 0)
+    while (!(x & 0x80000000u))
     {
-        return lval_long(x * y);
+        x <<= 1;
+        n++;
     }
-    if (strcmp(op, "/") == 0)
+    return n;
+}
+
+// knuth algorithm D, q holds m - n + 1 limbs and r holds n limbs
+void mag_divmod(const uint32_t *u, int m, const uint32_t *v, int n,
+                uint32_t *q, uint32_t *r)
+{
+    if (n == 1)
     {
-        if (y == 0)
+        uint64_t k = 0;
+        for (int j = m - 1; j >= 0; j--)
         {
-            return lval_err("divide by zero");
+            uint64_t cur = (k << 32) | u[j];
+            q[j] = (uint32_t)(cur / v[0]);
+            k = cur % v[0];
         }
-        return lval_long(x / y);
+        r[0] = (uint32_t)k;
+        return;
     }
-    if (strcmp(op, "%") == 0)
+
+    // normalise so the top bit of the divisor is set
+    int s = nlz32(v[n - 1]);
+    uint32_t *vn = malloc(sizeof(uint32_t) * n);
+    uint32_t *un = malloc(sizeof(uint32_t) * (m + 1));
+    for (int i = n - 1; i > 0; i--)
     {
-        return lval_long(x % y);
+        vn[i] = (v[i] << s) | (uint32_t)((uint64_t)v[i - 1] >> (32 - s));
     }
-    if (strcmp(op, "^") == 0)
+    vn[0] = v[0] << s;
+    un[m] = (uint32_t)((uint64_t)u[m - 1] >> (32 - s));
+    for (int i = m - 1; i > 0; i--)
     {
-        return lval_long(x ^ y);
+        un[i] = (u[i] << s) | (uint32_t)((uint64_t)u[i - 1] >> (32 - s));
     }
-    if (strcmp(op, "min") == 0)
+    un[0] = u[0] << s;
+
+    for (int j = m - n; j >= 0; j--)
     {
-        return lval_long(x > y ? y : x);
-    }
+        uint64_t num = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+        uint64_t qhat = num / vn[n - 1];
+        uint64_t rhat = num % vn[n - 1];
+        while (qhat >> 32 || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2]))
+        {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >> 32)
+            {
+                break;
+            }
+        }
+
+        // multiply and subtract
+        int64_t k = 0;
+        int64_t t;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t)un[i + j] - k - (int64_t)(p & 0xFFFFFFFF);
+            un[i + j] = (uint32_t)t;
+            k = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)un[j + n] - k;
+        un[j + n] = (uint32_t)t;
+
+        q[j] = (uint32_t)qhat;
+        if (t < 0)
+        {
+            // subtracted too much, add back
+            q[j]--;
+            uint64_t carry = 0;
+            for (int i = 0; i < n; i++)
+            {
+                carry += (uint64_t)un[i + j] + vn[i];
+                un[i + j] = (uint32_t)carry;
+                carry >>= 32;
+            }
+            un[j + n] += (uint32_t)carry;
+        }
+    }
+
+    for (int i = 0; i < n - 1; i++)
+    {
+        r[i] = (un[i] >> s) | (uint32_t)((uint64_t)un[i + 1] << (32 - s));
+    }
+    r[n - 1] = un[n - 1] >> s;
+
+    free(vn);
+    free(un);
+}
+
+int big_cmp(bignum *a, bignum *b)
+{
+    if (a->sign != b->sign)
+    {
+        return a->sign > b->sign ? 1 : -1;
+    }
+    return a->sign * mag_cmp(a->limbs, a->count, b->limbs, b->count);
+}
+
+bignum *big_add_signed(bignum *a, bignum *b, int bsign)
+{
+    if (bsign == 0)
+    {
+        return big_copy(a, 0);
+    }
+    if (a->sign == 0)
+    {
+        bignum *r = big_copy(b, 0);
+        r->sign = bsign;
+        return r;
+    }
+
+    if (a->sign == bsign)
+    {
+        bignum *r = big_copy(a->count >= b->count ? a : b,
+                             (a->count > b->count ? a->count : b->count) + 1);
+        bignum *s = a->count >= b->count ? b : a;
+        mag_add_to(r->limbs, r->count, s->limbs, s->count);
+        r->sign = bsign;
+        return big_trim(r);
+    }
+
+    int c = mag_cmp(a->limbs, a->count, b->limbs, b->count);
+    if (c == 0)
+    {
+        return big_new(0);
+    }
+    bignum *r = big_copy(c > 0 ? a : b, 0);
+    bignum *s = c > 0 ? b : a;
+    mag_sub_from(r->limbs, r->count, s->limbs, s->count);
+    r->sign = c > 0 ? a->sign : bsign;
+    return big_trim(r);
+}
+
+bignum *big_add(bignum *a, bignum *b)
+{
+    return big_add_signed(a, b, b->sign);
+}
+
+bignum *big_sub(bignum *a, bignum *b)
+{
+    return big_add_signed(a, b, -b->sign);
+}
+
+bignum *big_mul(bignum *a, bignum *b)
+{
+    bignum *r = big_new(a->count + b->count);
+    mag_mul(a->limbs, a->count, b->limbs, b->count, r->limbs);
+    r->sign = a->sign * b->sign;
+    return big_trim(r);
+}
+
+// truncating division like c, remainder takes the sign of the dividend
+void big_divmod(bignum *a, bignum *b, bignum **q, bignum **r)
+{
+    if (mag_cmp(a->limbs, a->count, b->limbs, b->count) < 0)
+    {
+        *q = big_new(0);
+        *r = big_copy(a, 0);
+        return;
+    }
+
+    *q = big_new(a->count - b->count + 1);
+    *r = big_new(b->count);
+    mag_divmod(a->limbs, a->count, b->limbs, b->count, (*q)->limbs, (*r)->limbs);
+    (*q)->sign = a->sign * b->sign;
+    (*r)->sign = a->sign;
+    big_trim(*q);
+    big_trim(*r);
+}
+
+bignum *big_from_str(const char *s)
+{
+    int sign = 1;
+    if (*s == '-')
+    {
+        sign = -1;
+        s++;
+    }
+
+    int digits = strlen(s);
+    bignum *b = big_new(digits / 9 + 2);
+    b->count = 0;
+
+    // fold in nine decimal digits at a time, 10^9 fits in a limb
+    int chunk = digits % 9 ? digits % 9 : 9;
+    while (*s)
+    {
+        uint32_t part = 0;
+        uint32_t scale = 1;
+        for (int i = 0; i < chunk; i++)
+        {
+            part = part * 10 + (*s++ - '0');
+            scale *= 10;
+        }
+        chunk = 9;
+
+        uint64_t carry = part;
+        for (int i = 0; i < b->count; i++)
+        {
+            carry += (uint64_t)b->limbs[i] * scale;
+            b->limbs[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry)
+        {
+            b->limbs[b->count++] = (uint32_t)carry;
+        }
+    }
+
+    b->sign = sign;
+    return big_trim(b);
+}
+
+char *big_to_str(bignum *b)
+{
+    // each limb needs at most ten decimal digits
+    char *str = malloc(b->count * 10 + 3);
+    char *end = str + b->count * 10 + 2;
+    char *p = end;
+    *p = '\0';
+
+    uint32_t *mag = malloc(sizeof(uint32_t) * (b->count + 1));
+    memcpy(mag, b->limbs, sizeof(uint32_t) * b->count);
+    int n = b->count;
+
+    do
+    {
+        // peel off nine digits per pass with a single short division
+        uint64_t rem = 0;
+        for (int i = n - 1; i >= 0; i--)
+        {
+            uint64_t cur = (rem << 32) | mag[i];
+            mag[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        while (n > 0 && mag[n - 1] == 0)
+        {
+            n--;
+        }
+        for (int i = 0; i < 9 && (n > 0 || rem); i++)
+        {
+            *--p = '0' + rem % 10;
+            rem /= 10;
+        }
+    } while (n > 0);
+
+    if (p == end)
+    {
+        *--p = '0';
+    }
+    if (b->sign < 0)
+    {
+        *--p = '-';
+    }
+
+    memmove(str, p, end - p + 1);
+    free(mag);
+    return str;
+}
+
+// optional hash-consing of read data. numbers and qexprs are looked up in
+// a weak table keyed by structure, so equal values share one node. the
+// table holds no references, a node leaves it when it dies or when its
+// sole owner is about to mutate it through lval_unshare.
+int hashcons_enabled = 0;
+
+lval **hc_table = NULL;
+int hc_cap = 0;
+int hc_used = 0;
+lval hc_tomb;
+
+unsigned long hc_mix(unsigned long h, unsigned long x)
+{
+    return (h ^ x) * 0x100000001b3ul;
+}
+
+unsigned long lval_hash(lval *v)
+{
+    unsigned long h = hc_mix(0xcbf29ce484222325ul, v->type);
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        return hc_mix(h, v->lng);
+    case LVAL_DOUBLE:
+    {
+        uint64_t bits;
+        memcpy(&bits, &v->dbl, sizeof(bits));
+        return hc_mix(h, bits);
+    }
+    case LVAL_BIGNUM:
+        h = hc_mix(h, v->big->sign);
+        for (int i = 0; i < v->big->count; i++)
+        {
+            h = hc_mix(h, v->big->limbs[i]);
+        }
+        return h;
+    case LVAL_SYM:
+        return hc_mix(h, str_hash(v->sym));
+    case LVAL_VECTOR:
+        h = hc_mix(h, v->vtype);
+        for (int i = 0; i < v->count; i++)
+        {
+            uint64_t bits;
+            if (v->vtype == LVAL_LONG)
+            {
+                bits = v->lngs[i];
+            }
+            else
+            {
+                memcpy(&bits, &v->dbls[i], sizeof(bits));
+            }
+            h = hc_mix(h, bits);
+        }
+        return h;
+    }
+
+    // children are already canonical, so their own hashes stand in for them
+    for (int i = 0; i < v->count; i++)
+    {
+        h = hc_mix(h, v->cell[i]->hash);
+    }
+    return hc_mix(h, v->count);
+}
+
+// structural identity, exact down to the bits of a double. lists compare
+// their items by pointer unless deep is set.
+int lval_identical(lval *x, lval *y, int deep)
+{
+    if (x == y)
+    {
+        return 1;
+    }
+    if (x->type != y->type)
+    {
+        return 0;
+    }
+    switch (x->type)
+    {
+    case LVAL_LONG:
+        return x->lng == y->lng;
+    case LVAL_DOUBLE:
+        return memcmp(&x->dbl, &y->dbl, sizeof(double)) == 0;
+    case LVAL_BIGNUM:
+        return x->big->sign == y->big->sign && x->big->count == y->big->count &&
+               memcmp(x->big->limbs, y->big->limbs, sizeof(uint32_t) * x->big->count) == 0;
+    case LVAL_SYM:
+        return strcmp(x->sym, y->sym) == 0;
+    case LVAL_ERR:
+        return strcmp(x->err, y->err) == 0;
+    case LVAL_VECTOR:
+        return x->vtype == y->vtype && x->count == y->count &&
+               memcmp(x->vtype == LVAL_LONG ? (void *)x->lngs : (void *)x->dbls,
+                      y->vtype == LVAL_LONG ? (void *)y->lngs : (void *)y->dbls,
+                      x->count * (x->vtype == LVAL_LONG ? sizeof(long) : sizeof(double))) == 0;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+        if (x->count != y->count)
+        {
+            return 0;
+        }
+        for (int i = 0; i < x->count; i++)
+        {
+            if (deep ? !lval_identical(x->cell[i], y->cell[i], 1) : x->cell[i] != y->cell[i])
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int lval_same(lval *x, lval *y)
+{
+    return x->hash == y->hash && lval_identical(x, y, 0);
+}
+
+void hc_insert(lval *v)
+{
+    int mask = hc_cap - 1;
+    int i = v->hash & mask;
+    while (hc_table[i] && hc_table[i] != &hc_tomb)
+    {
+        i = (i + 1) & mask;
+    }
+    if (hc_table[i] == NULL)
+    {
+        hc_used++;
+    }
+    hc_table[i] = v;
+}
+
+void hc_grow(void)
+{
+    lval **old = hc_table;
+    int old_cap = hc_cap;
+
+    hc_cap = hc_cap ? hc_cap * 2 : 1024;
+    hc_table = calloc(hc_cap, sizeof(lval *));
+    hc_used = 0;
+    for (int i = 0; i < old_cap; i++)
+    {
+        if (old[i] && old[i] != &hc_tomb)
+        {
+            hc_insert(old[i]);
+        }
+    }
+    free(old);
+}
+
+// the canonical node equal to v, or v itself once entered in the table
+lval *hc_intern(lval *v)
+{
+    if ((hc_used + 1) * 2 > hc_cap)
+    {
+        hc_grow();
+    }
+
+    v->hash = lval_hash(v);
+    int mask = hc_cap - 1;
+    for (int i = v->hash & mask; hc_table[i]; i = (i + 1) & mask)
+    {
+        if (hc_table[i] != &hc_tomb && lval_same(hc_table[i], v))
+        {
+            return hc_table[i];
+        }
+    }
+
+    hc_insert(v);
+    v->consed = 1;
+    return v;
+}
+
+void hc_remove(lval *v)
+{
+    int mask = hc_cap - 1;
+    for (int i = v->hash & mask; hc_table[i]; i = (i + 1) & mask)
+    {
+        if (hc_table[i] == v)
+        {
+            hc_table[i] = &hc_tomb;
+            break;
+        }
+    }
+    v->consed = 0;
+}
+
+// lvals live in pages owned by a mark-sweep collector. refcounting frees
+// most values the moment they die, the collector reclaims whatever it
+// misses (leaked references, and cycles once closures exist) in one
+// batch at safe points where every live value is reachable from gc_roots.
+#define GC_PAGE_SLOTS 4096
+
+typedef struct gc_page
+{
+    struct gc_page *next;
+    lval slots[GC_PAGE_SLOTS];
+} gc_page;
+
+gc_page *gc_pages = NULL;
+int gc_bump = GC_PAGE_SLOTS;
+lval *gc_free = NULL;
+long gc_live = 0;
+long gc_threshold = 1 << 16;
+
+lval **gc_roots = NULL;
+int gc_roots_count = 0;
+int gc_roots_cap = 0;
+
+// pending S-expressions of the evaluator, each with the frame it runs in
+typedef struct cont
+{
+    lval *env;
+    lval *expr;
+    int i;
+} cont;
+
+cont *eval_stack = NULL;
+int eval_count = 0;
+int eval_cap = 0;
+int eval_depth = 0;
+
+typedef int (*jit_fn)(const long *, long *);
+
+// compiled code, shared by a lambda and the VM frames running it
+typedef struct bcode
+{
+    int ref;
+    int calls;
+    int jit_state;
+    int jit_rebound;
+    int fold;
+    jit_fn jit;
+    size_t jit_size;
+    int *ops;
+    int count;
+    int cap;
+    int last;
+    lval **consts;
+    int nconsts;
+    int consts_cap;
+} bcode;
+
+enum
+{
+    OP_CONST,
+    OP_CONST2,
+    OP_LOAD,
+    OP_CALL,
+    OP_TAILCALL,
+    OP_RET,
+    OP_JMP,
+    OP_IF,
+    OP_CONST2_ADD,
+    OP_HEAD_TAIL,
+    OP_ARITH,
+    OP_ARITH_LONG,
+    OP_ARITH_DOUBLE,
+    OP_ARITH_POLY,
+    OP_FOLDED
+};
+
+// operators of the arithmetic call sites, in the order of arith_names
+enum
+{
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_MIN,
+    ARITH_MAX,
+    ARITH_COUNT
+};
+
+char *arith_names[] = {"+", "-", "*", "/", "%", "min", "max"};
+
+typedef struct vm_frame
+{
+    lval *env;
+    bcode *code;
+    int pc;
+} vm_frame;
+
+lval **vm_stack = NULL;
+int vm_sp = 0;
+int vm_stack_cap = 0;
+vm_frame *vm_frames = NULL;
+int vm_fcount = 0;
+int vm_fcap = 0;
+int vm_depth = 0;
+
+typedef struct memo_entry
+{
+    unsigned long hash;
+    lbuiltin fun;
+    lval *args;
+    lval *result;
+    struct memo_entry *prev;
+    struct memo_entry *next;
+    struct memo_entry *chain;
+} memo_entry;
+
+// memo_cap of 0 leaves the result cache off. calls whose arguments hold
+// more than MEMO_MAX_CELLS values in all are never cached
+#define MEMO_MAX_CELLS 32
+int memo_cap = 0;
+int memo_count = 0;
+memo_entry *memo_entries = NULL;
+memo_entry **memo_buckets = NULL;
+int memo_nbuckets = 0;
+memo_entry *memo_head = NULL;
+memo_entry *memo_tail = NULL;
+long memo_hits = 0;
+long memo_misses = 0;
+long memo_evictions = 0;
+
+lval *lval_alloc(int type)
+{
+    lval *v;
+    if (gc_free)
+    {
+        v = gc_free;
+        gc_free = v->next;
+    }
+    else
+    {
+        // bump allocate from the newest page
+        if (gc_bump == GC_PAGE_SLOTS)
+        {
+            gc_page *p = malloc(sizeof(gc_page));
+            p->next = gc_pages;
+            gc_pages = p;
+            gc_bump = 0;
+        }
+        v = &gc_pages->slots[gc_bump++];
+    }
+
+    v->type = type;
+    v->ref = 1;
+    v->mark = 0;
+    v->consed = 0;
+    gc_live++;
+    return v;
+}
+
+// hand a dead slot back to the allocator
+void lval_free(lval *v)
+{
+    v->type = LVAL_FREE;
+    v->mark = 0;
+    v->next = gc_free;
+    gc_free = v;
+    gc_live--;
+}
+
+void gc_root(lval *v)
+{
+    if (gc_roots_count == gc_roots_cap)
+    {
+        gc_roots_cap = gc_roots_cap ? gc_roots_cap * 2 : 64;
+        gc_roots = realloc(gc_roots, sizeof(lval *) * gc_roots_cap);
+    }
+    gc_roots[gc_roots_count++] = v;
+}
+
+void gc_unroot(lval *v)
+{
+    for (int i = gc_roots_count - 1; i >= 0; i--)
+    {
+        if (gc_roots[i] == v)
+        {
+            gc_roots[i] = gc_roots[--gc_roots_count];
+            return;
+        }
+    }
+}
+
+lval **gc_stack = NULL;
+int gc_stack_count = 0;
+int gc_stack_cap = 0;
+
+void gc_push(lval *v)
+{
+    if (v == NULL || v->mark)
+    {
+        return;
+    }
+    if (gc_stack_count == gc_stack_cap)
+    {
+        gc_stack_cap = gc_stack_cap ? gc_stack_cap * 2 : 256;
+        gc_stack = realloc(gc_stack, sizeof(lval *) * gc_stack_cap);
+    }
+    gc_stack[gc_stack_count++] = v;
+}
+
+void gc_push_code(bcode *c)
+{
+    for (int i = 0; c && i < c->nconsts; i++)
+    {
+        gc_push(c->consts[i]);
+    }
+}
+
+void gc_mark(void)
+{
+    for (int i = 0; i < gc_roots_count; i++)
+    {
+        gc_push(gc_roots[i]);
+    }
+    for (int i = 0; i < eval_count; i++)
+    {
+        gc_push(eval_stack[i].env);
+        gc_push(eval_stack[i].expr);
+    }
+    for (memo_entry *m = memo_head; m; m = m->next)
+    {
+        gc_push(m->args);
+        gc_push(m->result);
+    }
+    for (int i = 0; i < vm_sp; i++)
+    {
+        gc_push(vm_stack[i]);
+    }
+    for (int i = 0; i < vm_fcount; i++)
+    {
+        gc_push(vm_frames[i].env);
+        gc_push_code(vm_frames[i].code);
+    }
+
+    while (gc_stack_count)
+    {
+        lval *v = gc_stack[--gc_stack_count];
+        if (v->mark)
+        {
+            continue;
+        }
+        v->mark = 1;
+
+        switch (v->type)
+        {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            // a buffer keeps all the items it owns alive, not just the view
+            if (v->buf)
+            {
+                for (int i = v->buf->lo; i < v->buf->hi; i++)
+                {
+                    gc_push(((lval **)v->buf->data)[i]);
+                }
+            }
+            break;
+        case LVAL_FUN:
+            gc_push(v->formals);
+            gc_push(v->body);
+            gc_push(v->env);
+            gc_push_code(v->code);
+            break;
+        case LVAL_ENV:
+            for (int i = 0; i < v->count; i++)
+            {
+                gc_push(v->cell[i]);
+            }
+            gc_push(v->env);
+            break;
+        }
+    }
+}
+
+// drop a reference held by garbage, unless the target is garbage too
+void gc_drop(lval *x)
+{
+    if (x && x->mark && x->ref > 1)
+    {
+        x->ref--;
+    }
+}
+
+void lval_del(lval *v);
+void jit_release(bcode *c);
+
+// release code, from the collector when gc is set
+void code_release(bcode *c, int gc)
+{
+    if (c == NULL || --c->ref > 0)
+    {
+        return;
+    }
+    for (int i = 0; i < c->nconsts; i++)
+    {
+        if (gc)
+        {
+            gc_drop(c->consts[i]);
+        }
+        else
+        {
+            lval_del(c->consts[i]);
+        }
+    }
+    jit_release(c);
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+// free an unreachable value without following its references into other
+// garbage, only references to live values are dropped
+void gc_reclaim(lval *v)
+{
+    if (v->consed)
+    {
+        hc_remove(v);
+    }
+    switch (v->type)
+    {
+    case LVAL_BIGNUM:
+        big_del(v->big);
+        break;
+    case LVAL_ERR:
+        free(v->err);
+        break;
+    case LVAL_SYM:
+        free(v->sym);
+        scope_release(v->scope);
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_VECTOR:
+        if (v->buf && --v->buf->ref == 0)
+        {
+            lbuf *b = v->buf;
+            for (int i = b->lo; b->boxed && i < b->hi; i++)
+            {
+                gc_drop(((lval **)b->data)[i]);
+            }
+            free(b->data);
+            free(b);
+        }
+        break;
+    case LVAL_FUN:
+        gc_drop(v->formals);
+        gc_drop(v->body);
+        gc_drop(v->env);
+        code_release(v->code, 1);
+        scope_release(v->scope);
+        break;
+    case LVAL_ENV:
+        for (int i = 0; i < v->count; i++)
+        {
+            gc_drop(v->cell[i]);
+        }
+        free(v->cell);
+        gc_drop(v->env);
+        scope_release(v->scope);
+        break;
+    }
+    lval_free(v);
+}
+
+void gc_sweep(void)
+{
+    for (gc_page *p = gc_pages; p; p = p->next)
+    {
+        int used = p == gc_pages ? gc_bump : GC_PAGE_SLOTS;
+        for (int i = 0; i < used; i++)
+        {
+            lval *v = &p->slots[i];
+            if (v->type != LVAL_FREE && !v->mark)
+            {
+                gc_reclaim(v);
+            }
+        }
+    }
+
+    for (gc_page *p = gc_pages; p; p = p->next)
+    {
+        int used = p == gc_pages ? gc_bump : GC_PAGE_SLOTS;
+        for (int i = 0; i < used; i++)
+        {
+            p->slots[i].mark = 0;
+        }
+    }
+}
+
+// only call where every live value is reachable from gc_roots
+void gc_collect(void)
+{
+    gc_mark();
+    gc_sweep();
+    gc_threshold = gc_live * 2 > (1 << 16) ? gc_live * 2 : (1 << 16);
+}
+
+void gc_safepoint(void)
+{
+    if (gc_live > gc_threshold)
+    {
+        gc_collect();
+    }
+}
+
+lval *lval_long(long x)
+{
+    lval *v = lval_alloc(LVAL_LONG);
+    v->lng = x;
+    return v;
+}
+
+lval *lval_double(double x)
+{
+    lval *v = lval_alloc(LVAL_DOUBLE);
+    v->dbl = x;
+    return v;
+}
+
+// takes ownership of b, demoting to a long when it fits
+lval *lval_bignum(bignum *b)
+{
+    long x;
+    if (big_to_long(b, &x))
+    {
+        big_del(b);
+        return lval_long(x);
+    }
+
+    lval *v = lval_alloc(LVAL_BIGNUM);
+    v->big = b;
+    return v;
+}
+
+lval *lval_err(char *m)
+{
+    lval *v = lval_alloc(LVAL_ERR);
+    v->err = malloc(strlen(m) + 1);
+    strcpy(v->err, m);
+    return v;
+}
+
+lval *lval_sym(char *s)
+{
+    lval *v = lval_alloc(LVAL_SYM);
+    v->sym = malloc(strlen(s) + 1);
+    strcpy(v->sym, s);
+    v->scope = NULL;
+    return v;
+}
+
+lval *lval_builtin(lbuiltin f)
+{
+    lval *v = lval_alloc(LVAL_FUN);
+    v->fun = f;
+    v->formals = NULL;
+    v->body = NULL;
+    v->env = NULL;
+    v->scope = NULL;
+    v->code = NULL;
+    return v;
+}
+
+lval *lval_copy(lval *v);
+
+// a frame holds one slot per name in its scope, NULL until bound
+lval *lval_frame(lval *parent, scope *s)
+{
+    lval *v = lval_alloc(LVAL_ENV);
+    v->env = parent ? lval_copy(parent) : NULL;
+    v->scope = s;
+    s->ref++;
+    v->count = s->count;
+    v->cell = calloc(s->count ? s->count : 1, sizeof(lval *));
+    return v;
+}
+
+lval *lval_sexpr(void)
+{
+    lval *v = lval_alloc(LVAL_SEXPR);
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    v->off = 0;
+    return v;
+}
+
+lval *lval_qexpr(void)
+{
+    lval *v = lval_alloc(LVAL_QEXPR);
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    v->off = 0;
+    return v;
+}
+
+lbuf *lbuf_new(int size, int boxed, int cap, int lo)
+{
+    lbuf *b = malloc(sizeof(lbuf));
+    b->ref = 1;
+    b->size = size;
+    b->boxed = boxed;
+    b->lo = lo;
+    b->hi = lo;
+    b->cap = cap;
+    b->data = malloc((size_t)size * (cap > 0 ? cap : 1));
+    return b;
+}
+
+void lval_del(lval *v);
+lval *lval_copy(lval *v);
+
+void lbuf_release(lbuf *b)
+{
+    if (--b->ref > 0)
+    {
+        return;
+    }
+    if (b->boxed)
+    {
+        for (int i = b->lo; i < b->hi; i++)
+        {
+            lval_del(((lval **)b->data)[i]);
+        }
+    }
+    free(b->data);
+    free(b);
+}
+
+int lval_item_size(lval *v)
+{
+    if (v->type != LVAL_VECTOR)
+    {
+        return sizeof(lval *);
+    }
+    return v->vtype == LVAL_LONG ? sizeof(long) : sizeof(double);
+}
+
+// point the typed item pointers at the current view
+void lval_sync(lval *v)
+{
+    char *p = v->buf ? v->buf->data + (size_t)v->off * v->buf->size : NULL;
+    v->cell = v->type != LVAL_VECTOR ? (lval **)p : NULL;
+    v->lngs = v->type == LVAL_VECTOR && v->vtype == LVAL_LONG ? (long *)p : NULL;
+    v->dbls = v->type == LVAL_VECTOR && v->vtype == LVAL_DOUBLE ? (double *)p : NULL;
+}
+
+// give v sole ownership of exactly its own items, copying them if shared
+void lval_own(lval *v)
+{
+    lbuf *b = v->buf;
+    if (b == NULL)
+    {
+        return;
+    }
+
+    if (b->ref > 1)
+    {
+        lbuf *c = lbuf_new(b->size, b->boxed, v->count, 0);
+        if (b->boxed)
+        {
+            for (int i = 0; i < v->count; i++)
+            {
+                ((lval **)c->data)[i] = lval_copy(v->cell[i]);
+            }
+        }
+        else
+        {
+            memcpy(c->data, b->data + (size_t)v->off * b->size,
+                   (size_t)v->count * b->size);
+        }
+        c->hi = v->count;
+        b->ref--;
+        v->buf = c;
+        v->off = 0;
+        lval_sync(v);
+        return;
+    }
+
+    // items sliced off earlier are dead now nobody else can see them
+    if (b->boxed)
+    {
+        for (int i = b->lo; i < v->off; i++)
+        {
+            lval_del(((lval **)b->data)[i]);
+        }
+        for (int i = v->off + v->count; i < b->hi; i++)
+        {
+            lval_del(((lval **)b->data)[i]);
+        }
+    }
+    b->lo = v->off;
+    b->hi = v->off + v->count;
+}
+
+// make room for more items either side of an owned view
+void lval_reserve(lval *v, int front, int back)
+{
+    int size = lval_item_size(v);
+    if (v->buf == NULL)
+    {
+        v->buf = lbuf_new(size, v->type != LVAL_VECTOR, front + back + 4, front);
+        v->off = front;
+        lval_sync(v);
+        return;
+    }
+
+    lbuf *b = v->buf;
+    if (b->lo >= front && b->cap - b->hi >= back)
+    {
+        return;
+    }
+
+    // grow geometrically, centring the items when growing at the front
+    int cap = (v->count + front + back) * 2 + 4;
+    int lo = front ? (cap - v->count) / 2 : 0;
+    char *data = malloc((size_t)size * cap);
+    memcpy(data + (size_t)lo * size, b->data + (size_t)b->lo * size,
+           (size_t)v->count * size);
+    free(b->data);
+    b->data = data;
+    b->cap = cap;
+    b->lo = lo;
+    b->hi = lo + v->count;
+    v->off = lo;
+    lval_sync(v);
+}
+
+// add one item at either end. a spare slot next to the view can be claimed
+// in place even when the buffer is shared, as no other view can see it
+void lval_push(lval *v, const void *item, int front)
+{
+    lbuf *b = v->buf;
+    int claim = b && (front ? v->off == b->lo && b->lo > 0
+                            : v->off + v->count == b->hi && b->hi < b->cap);
+    if (!claim)
+    {
+        lval_own(v);
+        lval_reserve(v, front, !front);
+        b = v->buf;
+    }
+
+    if (front)
+    {
+        b->lo--;
+        v->off--;
+        memcpy(b->data + (size_t)b->lo * b->size, item, b->size);
+    }
+    else
+    {
+        memcpy(b->data + (size_t)b->hi * b->size, item, b->size);
+        b->hi++;
+    }
+    v->count++;
+    lval_sync(v);
+}
+
+// narrow the view, the items left out stay with the buffer
+lval *lval_slice(lval *v, int start, int count)
+{
+    v->off += start;
+    v->count = count;
+    lval_sync(v);
+    return v;
+}
+
+// a qexpr of same typed numbers stored unboxed, vtype is LVAL_LONG or LVAL_DOUBLE
+lval *lval_vector(int vtype, int count)
+{
+    lval *v = lval_alloc(LVAL_VECTOR);
+    v->vtype = vtype;
+    v->count = count;
+    v->off = 0;
+    v->buf = lbuf_new(lval_item_size(v), 0, count, 0);
+    v->buf->hi = count;
+    lval_sync(v);
+    return v;
+}
+
+// share v, anyone about to mutate a shared value takes a private
+// header first with lval_unshare
+lval *lval_copy(lval *v)
+{
+    v->ref++;
+    return v;
+}
+
+// a private header for v, list items stay shared with the original
+lval *lval_clone(lval *v)
+{
+    lval *x = lval_alloc(v->type);
+    *x = *v;
+    x->ref = 1;
+    x->consed = 0;
+    switch (v->type)
+    {
+    case LVAL_BIGNUM:
+        x->big = big_copy(v->big, 0);
+        break;
+    case LVAL_ERR:
+        x->err = malloc(strlen(v->err) + 1);
+        strcpy(x->err, v->err);
+        break;
+    case LVAL_SYM:
+        x->sym = malloc(strlen(v->sym) + 1);
+        strcpy(x->sym, v->sym);
+        if (x->scope)
+        {
+            x->scope->ref++;
+        }
+        break;
+    case LVAL_FUN:
+        if (x->scope)
+        {
+            x->scope->ref++;
+            x->code->ref++;
+            lval_copy(x->formals);
+            lval_copy(x->body);
+            lval_copy(x->env);
+        }
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_VECTOR:
+        // items are shared, writers go through lval_own first
+        if (x->buf)
+        {
+            x->buf->ref++;
+        }
+        break;
+    }
+    return x;
+}
+
+lval *lval_unshare(lval *v)
+{
+    if (v->ref == 1)
+    {
+        if (v->consed)
+        {
+            hc_remove(v);
+        }
+        return v;
+    }
+    v->ref--;
+    return lval_clone(v);
+}
+
+void lval_del(lval *v)
+{
+    if (--v->ref > 0)
+    {
+        return;
+    }
+    if (v->consed)
+    {
+        hc_remove(v);
+    }
+
+    switch (v->type)
+    {
+    case LVAL_DOUBLE:
+        break;
+    case LVAL_LONG:
+        break;
+    case LVAL_BIGNUM:
+        big_del(v->big);
+        break;
+    case LVAL_ERR:
+        free(v->err);
+        break;
+    case LVAL_SYM:
+        free(v->sym);
+        scope_release(v->scope);
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_VECTOR:
+        if (v->buf)
+        {
+            lbuf_release(v->buf);
+        }
+        break;
+    case LVAL_FUN:
+        if (v->scope)
+        {
+            lval_del(v->formals);
+            lval_del(v->body);
+            lval_del(v->env);
+            code_release(v->code, 0);
+            scope_release(v->scope);
+        }
+        break;
+    case LVAL_ENV:
+        for (int i = 0; i < v->count; i++)
+        {
+            if (v->cell[i])
+            {
+                lval_del(v->cell[i]);
+            }
+        }
+        free(v->cell);
+        if (v->env)
+        {
+            lval_del(v->env);
+        }
+        scope_release(v->scope);
+        break;
+    }
+
+    lval_free(v);
+}
+
+lval *lval_read_long(mpc_ast_t *t)
+{
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    return errno != ERANGE ? lval_long(x) : lval_bignum(big_from_str(t->contents));
+}
+
+lval *lval_read_double(mpc_ast_t *t)
+{
+    errno = 0;
+    double x = strtod(t->contents, NULL);
+    return errno != ERANGE ? lval_double(x) : lval_err("invalid double");
+}
+
+lval *lval_add(lval *v, lval *x)
+{
+    lval_push(v, &x, 0);
+    return v;
+}
+
+int lval_is_qexpr(lval *v)
+{
+    return v->type == LVAL_QEXPR || v->type == LVAL_VECTOR;
+}
+
+// switch a qexpr of same typed numbers to the packed representation
+lval *lval_pack(lval *v)
+{
+    if (v->type != LVAL_QEXPR || v->count == 0)
+    {
+        return v;
+    }
+
+    int vtype = v->cell[0]->type;
+    if (vtype != LVAL_LONG && vtype != LVAL_DOUBLE)
+    {
+        return v;
+    }
+    for (int i = 1; i < v->count; i++)
+    {
+        if (v->cell[i]->type != vtype)
+        {
+            return v;
+        }
+    }
+
+    lval *p = lval_vector(vtype, v->count);
+    for (int i = 0; i < v->count; i++)
+    {
+        if (vtype == LVAL_LONG)
+        {
+            p->lngs[i] = v->cell[i]->lng;
+        }
+        else
+        {
+            p->dbls[i] = v->cell[i]->dbl;
+        }
+    }
+
+    lbuf_release(v->buf);
+    v->buf = p->buf;
+    v->off = 0;
+    v->vtype = vtype;
+    lval_free(p);
+    v->type = LVAL_VECTOR;
+    lval_sync(v);
+    return v;
+}
+
+// box a packed vector back into a plain qexpr
+lval *lval_unpack(lval *v)
+{
+    if (v->type != LVAL_VECTOR)
+    {
+        return v;
+    }
+
+    lbuf *b = lbuf_new(sizeof(lval *), 1, v->count, 0);
+    for (int i = 0; i < v->count; i++)
+    {
+        ((lval **)b->data)[i] = v->vtype == LVAL_LONG ? lval_long(v->lngs[i])
+                                                      : lval_double(v->dbls[i]);
+    }
+    b->hi = v->count;
+
+    lbuf_release(v->buf);
+    v->buf = b;
+    v->off = 0;
+    v->type = LVAL_QEXPR;
+    lval_sync(v);
+    return v;
+}
+
+lval *lval_read(mpc_ast_t *t)
+{
+    if (strstr(t->tag, "double"))
+    {
+        return lval_read_double(t);
+    }
+    if (strstr(t->tag, "long"))
+    {
+        return lval_read_long(t);
+    }
+    if (strstr(t->tag, "symbol"))
+    {
+        return lval_sym(t->contents);
+    }
+
+    lval *x = NULL;
+    if (strcmp(t->tag, ">") == 0)
+    {
+        x = lval_sexpr();
+    }
+    if (strstr(t->tag, "sexpr"))
+    {
+        x = lval_sexpr();
+    }
+    if (strstr(t->tag, "qexpr"))
+    {
+        x = lval_qexpr();
+    }
+
+    for (int i = 0; i < t->children_num; i++)
+    {
+        if (strcmp(t->children[i]->contents, "(") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->contents, ")") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->contents, "}") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->contents, "{") == 0)
+        {
+            continue;
+        }
+        if (strcmp(t->children[i]->tag, "regex") == 0)
+        {
+            continue;
+        }
+        x = lval_add(x, lval_read(t->children[i]));
+    }
+
+    return lval_pack(x);
+}
+
+void lval_print(lval *v);
+
+void lval_expr_print(lval *v, char open, char close)
+{
+    putchar(open);
+    for (int i = 0; i < v->count; i++)
+    {
+        lval_print(v->cell[i]);
+
+        if (i != (v->count - 1))
+        {
+            putchar(' ');
+        }
+    }
+    putchar(close);
+}
+
+void lval_print(lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        printf("%li", v->lng);
+        break;
+    case LVAL_BIGNUM:
+    {
+        char *str = big_to_str(v->big);
+        printf("%s", str);
+        free(str);
+        break;
+    }
+    case LVAL_DOUBLE:
+        printf("%f", v->dbl);
+        break;
+    case LVAL_ERR:
+        printf("error: %s", v->err);
+        break;
+    case LVAL_SYM:
+        printf("%s", v->sym);
+        break;
+    case LVAL_FUN:
+        if (v->fun)
+        {
+            printf("<builtin>");
+        }
+        else
+        {
+            printf("(\\ ");
+            lval_print(v->formals);
+            putchar(' ');
+            lval_print(v->body);
+            putchar(')');
+        }
+        break;
+    case LVAL_ENV:
+        printf("<env>");
+        break;
+    case LVAL_SEXPR:
+        lval_expr_print(v, '(', ')');
+        break;
+    case LVAL_QEXPR:
+        lval_expr_print(v, '{', '}');
+        break;
+    case LVAL_VECTOR:
+        putchar('{');
+        for (int i = 0; i < v->count; i++)
+        {
+            if (v->vtype == LVAL_LONG)
+            {
+                printf("%li", v->lngs[i]);
+            }
+            else
+            {
+                printf("%f", v->dbls[i]);
+            }
+
+            if (i != (v->count - 1))
+            {
+                putchar(' ');
+            }
+        }
+        putchar('}');
+        break;
+    }
+}
+
+void lval_println(lval *v)
+{
+    lval_print(v);
+    putchar('\n');
+}
+
+lval *eval_bigs(bignum *x, char *op, bignum *y)
+{
+    if (strcmp(op, "+") == 0)
+    {
+        return lval_bignum(big_add(x, y));
+    }
+    if (strcmp(op, "-") == 0)
+    {
+        return lval_bignum(big_sub(x, y));
+    }
+    if (strcmp(op, "*") == 0)
+    {
+        return lval_bignum(big_mul(x, y));
+    }
+    if (strcmp(op, "/") == 0 || strcmp(op, "%") == 0)
+    {
+        if (y->sign == 0)
+        {
+            return lval_err("divide by zero");
+        }
+        bignum *q, *r;
+        big_divmod(x, y, &q, &r);
+        if (op[0] == '/')
+        {
+            big_del(r);
+            return lval_bignum(q);
+        }
+        big_del(q);
+        return lval_bignum(r);
+    }
+    if (strcmp(op, "min") == 0)
+    {
+        return lval_bignum(big_copy(big_cmp(x, y) > 0 ? y : x, 0));
+    }
+    if (strcmp(op, "max") == 0)
+    {
+        return lval_bignum(big_copy(big_cmp(x, y) > 0 ? x : y, 0));
+    }
+
+    return lval_err("bad operator for bignum");
+}
+
+// redo an overflowing long operation in arbitrary precision
+lval *eval_longs_promoted(long x, char *op, long y)
+{
+    bignum *a = big_from_long(x);
+    bignum *b = big_from_long(y);
+    lval *r = eval_bigs(a, op, b);
+    big_del(a);
+    big_del(b);
+    return r;
+}
+
+lval *eval_longs(long x, char *op, long y)
+{
+    long r;
+    if (strcmp(op, "+") == 0)
+    {
+        if (long_add_overflow(x, y, &r))
+        {
+            return eval_longs_promoted(x, op, y);
+        }
+        return lval_long(r);
+    }
+    if (strcmp(op, "-") == 0)
+    {
+        if (long_sub_overflow(x, y, &r))
+        {
+            return eval_longs_promoted(x, op, y);
+        }
+        return lval_long(r);
+    }
+    if (strcmp(op, "*") == 0)
+    {
+        if (long_mul_overflow(x, y, &r))
+        {
+            return eval_longs_promoted(x, op, y);
+        }
+        return lval_long(r);
+    }
+    if (strcmp(op, "/") == 0)
+    {
+        if (y == 0)
+        {
+            return lval_err("divide by zero");
+        }
+        if (x == LONG_MIN && y == -1)
+        {
+            return eval_longs_promoted(x, op, y);
+        }
+        return lval_long(x / y);
+    }
+    if (strcmp(op, "%") == 0)
+    {
+        if (y == 0)
+        {
+            return lval_err("divide by zero");
+        }
+        if (y == -1)
+        {
+            return lval_long(0);
+        }
+        return lval_long(x % y);
+    }
+    if (strcmp(op, "^") == 0)
+    {
+        return lval_long(x ^ y);
+    }
+    if (strcmp(op, "min") == 0)
+    {
+        return lval_long(x > y ? y : x);
+    }
+    if (strcmp(op, "max") == 0)
+    {
+        return lval_long(x > y ? x : y);
+    }
+
+    return lval_err("bad operator bro");
+}
+
+lval *eval_doubles(double x, char *op, double y)
+{
+    if (strcmp(op, "+") == 0)
+    {
+        return lval_double(x + y);
+    }
+    if (strcmp(op, "-") == 0)
+    {
+        return lval_double(x - y);
+    }
+    if (strcmp(op, "*") == 0)
+    {
+        return lval_double(x * y);
+    }
+    if (strcmp(op, "/") == 0)
+    {
+        if (y == 0)
+        {
+            return lval_err("divide by zero");
+        }
+        return lval_double(x / y);
+    }
+    if (strcmp(op, "min") == 0)
+    {
+        return lval_double(x > y ? y : x);
+    }
     if (strcmp(op, "max") == 0)
     {
-        return lval_long(x > y ? x : y);
+        return lval_double(x > y ? x : y);
+    }
+
+    return lval_err("bad operator bro");
+}
+
+double lval_to_double(lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        return (double)v->lng;
+    case LVAL_BIGNUM:
+        return big_to_double(v->big);
+    }
+    return v->dbl;
+}
+
+// combine two numbers of any numeric type, leaving both intact
+lval *eval_nums(lval *x, char *op, lval *y)
+{
+    if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE)
+    {
+        return eval_doubles(lval_to_double(x), op, lval_to_double(y));
+    }
+    if (x->type == LVAL_BIGNUM || y->type == LVAL_BIGNUM)
+    {
+        bignum *a = x->type == LVAL_BIGNUM ? x->big : big_from_long(x->lng);
+        bignum *b = y->type == LVAL_BIGNUM ? y->big : big_from_long(y->lng);
+        lval *r = eval_bigs(a, op, b);
+        if (a != x->big)
+        {
+            big_del(a);
+        }
+        if (b != y->big)
+        {
+            big_del(b);
+        }
+        return r;
+    }
+    return eval_longs(x->lng, op, y->lng);
+}
+
+lval *lval_pop(lval *v, int i)
+{
+    // popping an end of a shared list only narrows the view
+    if (v->buf->ref > 1 && (i == 0 || i == v->count - 1))
+    {
+        lval *x = lval_copy(v->cell[i]);
+        lval_slice(v, i == 0, v->count - 1);
+        return x;
+    }
+
+    lval_own(v);
+    lval *x = v->cell[i];
+    if (i == 0)
+    {
+        v->buf->lo++;
+        v->off++;
+    }
+    else
+    {
+        memmove(&v->cell[i], &v->cell[i + 1],
+                sizeof(lval *) * (v->count - i - 1));
+        v->buf->hi--;
+    }
+
+    v->count--;
+    lval_sync(v);
+    return x;
+}
+
+lval *lval_take(lval *v, int i)
+{
+    lval *x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+#define LASSERT(args, cond, err) \
+    if (!(cond))                 \
+    {                            \
+        lval_del(args);          \
+        return lval_err(err);    \
+    }
+
+lval *builtin_head(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 1,
+            "head passed more than one qexpr");
+
+    LASSERT(a, lval_is_qexpr(a->cell[0]),
+            "head passed non-qexpr");
+
+    LASSERT(a, a->cell[0]->count != 0,
+            "head on empty qexpr");
+
+    // take qexpr and keep only the head in view
+    lval *v = lval_unshare(lval_take(a, 0));
+    return lval_slice(v, 0, 1);
+}
+
+lval *builtin_tail(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 1,
+            "tail passed more than one qexpr");
+
+    LASSERT(a, lval_is_qexpr(a->cell[0]),
+            "tail passed non-qexpr");
+
+    LASSERT(a, a->cell[0]->count != 0,
+            "tail on empty qexpr");
+
+    // take qexpr and step past the head
+    lval *v = lval_unshare(lval_take(a, 0));
+    return lval_slice(v, 1, v->count - 1);
+}
+
+lval *builtin_list(lval *e, lval *a)
+{
+    a->type = LVAL_QEXPR;
+    return lval_pack(a);
+}
+
+lval *lval_eval(lval *e, lval *v);
+
+lval *builtin_eval(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 1,
+            "eval passed more than one qexpr");
+
+    LASSERT(a, lval_is_qexpr(a->cell[0]),
+            "eval passed non-qexpr");
+
+    // the evaluator runs the result in tail position
+    lval *x = lval_unpack(lval_unshare(lval_take(a, 0)));
+    x->type = LVAL_SEXPR;
+    return x;
+}
+
+lval *lval_join(lval *x, lval *y)
+{
+    if (y->count == 0)
+    {
+        lval_del(y);
+        return x;
+    }
+    if (x->count == 0)
+    {
+        lval_del(x);
+        return y;
+    }
+
+    x = lval_unshare(x);
+    y = lval_unshare(y);
+
+    // packed vectors of one element type concatenate without boxing
+    if (x->type != LVAL_VECTOR || y->type != LVAL_VECTOR || x->vtype != y->vtype)
+    {
+        lval_unpack(x);
+        lval_unpack(y);
+    }
+
+    // append into x's spare slots in place when nobody else can see them
+    lbuf *b = x->buf;
+    if (x->off + x->count != b->hi || b->cap - b->hi < y->count)
+    {
+        lval_own(x);
+        lval_reserve(x, 0, y->count);
+        b = x->buf;
+    }
+
+    char *dst = b->data + (size_t)b->hi * b->size;
+    if (!b->boxed)
+    {
+        memcpy(dst, y->buf->data + (size_t)y->off * b->size, (size_t)y->count * b->size);
+    }
+    else if (y->buf->ref == 1)
+    {
+        // move the items over, leaving y's buffer owning none
+        lval_own(y);
+        memcpy(dst, y->cell, sizeof(lval *) * y->count);
+        y->buf->hi = y->buf->lo;
+    }
+    else
+    {
+        for (int i = 0; i < y->count; i++)
+        {
+            ((lval **)dst)[i] = lval_copy(y->cell[i]);
+        }
+    }
+
+    b->hi += y->count;
+    x->count += y->count;
+    lval_sync(x);
+    lval_del(y);
+    return x;
+}
+
+lval *builtin_join(lval *e, lval *a)
+{
+    for (int i = 0; i < a->count; i++)
+    {
+        LASSERT(a, lval_is_qexpr(a->cell[i]),
+                "join passed non-qexpr");
+    }
+
+    lval *x = lval_pop(a, 0);
+    while (a->count)
+    {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+
+    lval_del(a);
+    return lval_pack(x);
+}
+
+lval *builtin_len(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 1,
+            "len passed more than one qexpr");
+
+    LASSERT(a, lval_is_qexpr(a->cell[0]),
+            "len passed non-qexpr");
+
+    lval *v = lval_take(a, 0);
+    lval *len = lval_long(v->count);
+
+    lval_del(v);
+
+    return len;
+}
+
+lval *builtin_cons(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 2,
+            "cons passed too many args");
+
+    LASSERT(a, lval_is_qexpr(a->cell[1]),
+            "cons passed non-qexpr on right");
+
+    lval *x = lval_eval(e, lval_pop(a, 0));
+    lval *xs = lval_unshare(lval_take(a, 0));
+
+    // prepend in place when x matches the packed element type
+    if (xs->type == LVAL_VECTOR && x->type == xs->vtype)
+    {
+        lval_push(xs, x->type == LVAL_LONG ? (void *)&x->lng : (void *)&x->dbl, 1);
+        lval_del(x);
+        return xs;
+    }
+
+    lval_unpack(xs);
+    lval_push(xs, &x, 1);
+    return xs->count == 1 ? lval_pack(xs) : xs;
+}
+
+lval *builtin_init(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 1,
+            "init passed more than one qexpr");
+
+    LASSERT(a, lval_is_qexpr(a->cell[0]),
+            "init passed non-qexpr");
+
+    LASSERT(a, a->cell[0]->count != 0,
+            "init on empty qexpr");
+
+    // take qexpr and drop the last item from view
+    lval *v = lval_unshare(lval_take(a, 0));
+    return lval_slice(v, 0, v->count - 1);
+}
+
+// unboxed folds for builtin_op when every argument has the same type.
+// they return NULL whenever the exact answer needs the boxed path
+// (overflow, divide by zero, unknown op) so results never differ.
+#if defined(__GNUC__) || defined(__clang__)
+#define FOLD_LANES 4
+typedef long long_vec __attribute__((vector_size(FOLD_LANES * sizeof(long))));
+typedef unsigned long ulong_vec __attribute__((vector_size(FOLD_LANES * sizeof(long))));
+#endif
+
+int fold_long_sum(const long *xs, int n, long *out)
+{
+    long acc = 0;
+    int i = 0;
+
+#ifdef FOLD_LANES
+    // wrapping lane sums, a lane overflowed iff its sign flipped against both inputs
+    long_vec vacc = {0};
+    long_vec vov = {0};
+    for (; i + FOLD_LANES <= n; i += FOLD_LANES)
+    {
+        long_vec x;
+        memcpy(&x, xs + i, sizeof(x));
+        long_vec s = (long_vec)((ulong_vec)vacc + (ulong_vec)x);
+        vov |= (vacc ^ s) & (x ^ s);
+        vacc = s;
+    }
+    for (int j = 0; j < FOLD_LANES; j++)
+    {
+        if (vov[j] < 0 || long_add_overflow(acc, vacc[j], &acc))
+        {
+            return 0;
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        if (long_add_overflow(acc, xs[i], &acc))
+        {
+            return 0;
+        }
+    }
+
+    *out = acc;
+    return 1;
+}
+
+long fold_long_minmax(const long *xs, int n, int max)
+{
+    long acc = xs[0];
+    int i = 0;
+
+#ifdef FOLD_LANES
+    if (n >= FOLD_LANES)
+    {
+        long_vec vacc;
+        memcpy(&vacc, xs, sizeof(vacc));
+        for (i = FOLD_LANES; i + FOLD_LANES <= n; i += FOLD_LANES)
+        {
+            long_vec x;
+            memcpy(&x, xs + i, sizeof(x));
+            long_vec take = max ? x > vacc : x < vacc;
+            vacc = (x & take) | (vacc & ~take);
+        }
+        acc = vacc[0];
+        for (int j = 1; j < FOLD_LANES; j++)
+        {
+            acc = (max ? vacc[j] > acc : vacc[j] < acc) ? vacc[j] : acc;
+        }
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        acc = (max ? xs[i] > acc : xs[i] < acc) ? xs[i] : acc;
+    }
+    return acc;
+}
+
+lval *fold_longs(const long *xs, int n, char *op)
+{
+    long acc;
+    if (strcmp(op, "+") == 0)
+    {
+        return fold_long_sum(xs, n, &acc) ? lval_long(acc) : NULL;
+    }
+    if (strcmp(op, "-") == 0)
+    {
+        if (!fold_long_sum(xs + 1, n - 1, &acc) ||
+            long_sub_overflow(xs[0], acc, &acc))
+        {
+            return NULL;
+        }
+        return lval_long(acc);
+    }
+    if (strcmp(op, "min") == 0 || strcmp(op, "max") == 0)
+    {
+        return lval_long(fold_long_minmax(xs, n, op[1] == 'a'));
+    }
+
+    acc = xs[0];
+    for (int i = 1; i < n; i++)
+    {
+        long y = xs[i];
+        switch (op[0])
+        {
+        case '*':
+            if (long_mul_overflow(acc, y, &acc))
+            {
+                return NULL;
+            }
+            break;
+        case '/':
+        case '%':
+            if (y == 0 || (acc == LONG_MIN && y == -1))
+            {
+                return NULL;
+            }
+            acc = op[0] == '/' ? acc / y : acc % y;
+            break;
+        case '^':
+            acc ^= y;
+            break;
+        default:
+            return NULL;
+        }
+    }
+    return lval_long(acc);
+}
+
+// doubles fold strictly left to right so rounding matches the boxed path
+lval *fold_doubles(const double *xs, int n, char *op)
+{
+    double acc = xs[0];
+    if (strcmp(op, "min") == 0 || strcmp(op, "max") == 0)
+    {
+        int max = op[1] == 'a';
+        for (int i = 1; i < n; i++)
+        {
+            acc = max ? (acc > xs[i] ? acc : xs[i]) : (acc > xs[i] ? xs[i] : acc);
+        }
+        return lval_double(acc);
+    }
+
+    for (int i = 1; i < n; i++)
+    {
+        switch (op[0])
+        {
+        case '+':
+            acc += xs[i];
+            break;
+        case '-':
+            acc -= xs[i];
+            break;
+        case '*':
+            acc *= xs[i];
+            break;
+        case '/':
+            if (xs[i] == 0)
+            {
+                return NULL;
+            }
+            acc /= xs[i];
+            break;
+        default:
+            return NULL;
+        }
+    }
+    return lval_double(acc);
+}
+
+#define FOLD_STACK 256
+
+// unbox a homogeneous argument list and fold it in one go. Short lists are
+// unboxed on the stack, only very long ones go to the heap
+lval *fold_nums(lval *a, int type, char *op)
+{
+    union
+    {
+        long lngs[FOLD_STACK];
+        double dbls[FOLD_STACK];
+    } stack;
+    void *heap = NULL;
+    lval *r = NULL;
+    if (type != LVAL_LONG && type != LVAL_DOUBLE)
+    {
+        return NULL;
+    }
+    if (a->count > FOLD_STACK)
+    {
+        heap = malloc((type == LVAL_LONG ? sizeof(long) : sizeof(double)) * a->count);
+    }
+
+    if (type == LVAL_LONG)
+    {
+        long *xs = heap ? heap : stack.lngs;
+        for (int i = 0; i < a->count; i++)
+        {
+            xs[i] = a->cell[i]->lng;
+        }
+        r = fold_longs(xs, a->count, op);
+    }
+    else
+    {
+        double *xs = heap ? heap : stack.dbls;
+        for (int i = 0; i < a->count; i++)
+        {
+            xs[i] = a->cell[i]->dbl;
+        }
+        r = fold_doubles(xs, a->count, op);
+    }
+    free(heap);
+    return r;
+}
+
+// elementwise kernels for packed vectors, acc[i] op= ys[i * stride] with
+// stride 0 broadcasting a scalar. 0 means the exact answer needs boxing.
+int vec_longs(long *acc, const long *ys, int stride, int n, char *op)
+{
+    int ov = 0;
+    switch (op[0])
+    {
+    case '+':
+        for (int i = 0; i < n; i++)
+        {
+            ov |= long_add_overflow(acc[i], ys[i * stride], &acc[i]);
+        }
+        return !ov;
+    case '-':
+        for (int i = 0; i < n; i++)
+        {
+            ov |= long_sub_overflow(acc[i], ys[i * stride], &acc[i]);
+        }
+        return !ov;
+    case '*':
+        for (int i = 0; i < n; i++)
+        {
+            ov |= long_mul_overflow(acc[i], ys[i * stride], &acc[i]);
+        }
+        return !ov;
+    case '/':
+    case '%':
+        for (int i = 0; i < n; i++)
+        {
+            long y = ys[i * stride];
+            if (y == 0 || (acc[i] == LONG_MIN && y == -1))
+            {
+                return 0;
+            }
+            acc[i] = op[0] == '/' ? acc[i] / y : acc[i] % y;
+        }
+        return 1;
+    case '^':
+        for (int i = 0; i < n; i++)
+        {
+            acc[i] ^= ys[i * stride];
+        }
+        return 1;
+    case 'm':
+        for (int i = 0; i < n; i++)
+        {
+            long y = ys[i * stride];
+            acc[i] = op[1] == 'a' ? (acc[i] > y ? acc[i] : y) : (acc[i] > y ? y : acc[i]);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+int vec_doubles(double *acc, const double *ys, int stride, int n, char *op)
+{
+    switch (op[0])
+    {
+    case '+':
+        for (int i = 0; i < n; i++)
+        {
+            acc[i] += ys[i * stride];
+        }
+        return 1;
+    case '-':
+        for (int i = 0; i < n; i++)
+        {
+            acc[i] -= ys[i * stride];
+        }
+        return 1;
+    case '*':
+        for (int i = 0; i < n; i++)
+        {
+            acc[i] *= ys[i * stride];
+        }
+        return 1;
+    case '/':
+        for (int i = 0; i < n; i++)
+        {
+            if (ys[i * stride] == 0)
+            {
+                return 0;
+            }
+            acc[i] /= ys[i * stride];
+        }
+        return 1;
+    case 'm':
+        for (int i = 0; i < n; i++)
+        {
+            double y = ys[i * stride];
+            acc[i] = op[1] == 'a' ? (acc[i] > y ? acc[i] : y) : (acc[i] > y ? y : acc[i]);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+lval *builtin_op(lval *a, char *op);
+
+// element i of a list argument, or the scalar itself
+lval *vector_arg_nth(lval *x, int i)
+{
+    if (x->type == LVAL_VECTOR)
+    {
+        return x->vtype == LVAL_LONG ? lval_long(x->lngs[i]) : lval_double(x->dbls[i]);
+    }
+    if (x->type == LVAL_QEXPR)
+    {
+        return lval_copy(x->cell[i]);
+    }
+    return lval_copy(x);
+}
+
+int lval_is_num(lval *v);
+
+// a qexpr holding only numbers, packed or not
+int lval_is_num_list(lval *v)
+{
+    if (v->type == LVAL_VECTOR)
+    {
+        return 1;
+    }
+    if (v->type != LVAL_QEXPR)
+    {
+        return 0;
+    }
+    for (int i = 0; i < v->count; i++)
+    {
+        if (!lval_is_num(v->cell[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// elementwise arithmetic over numeric list arguments, scalars are broadcast.
+// only packed vectors and scalars take the unboxed kernels, boxed lists go
+// element by element so both representations give the same answers.
+lval *vector_op(lval *a, char *op)
+{
+    int n = -1;
+    int vtype = LVAL_LONG;
+    for (int i = 0; i < a->count; i++)
+    {
+        lval *x = a->cell[i];
+        if (lval_is_qexpr(x))
+        {
+            LASSERT(a, n == -1 || n == x->count,
+                    "vectors differ in length");
+            n = x->count;
+        }
+        int t = x->type == LVAL_VECTOR ? x->vtype : x->type;
+        if (t == LVAL_BIGNUM || t == LVAL_QEXPR)
+        {
+            vtype = LVAL_BIGNUM;
+        }
+        else if (t == LVAL_DOUBLE && vtype == LVAL_LONG)
+        {
+            vtype = LVAL_DOUBLE;
+        }
+    }
+
+    // unary minus folds its only argument into zeros
+    int unary = strcmp(op, "-") == 0 && a->count == 1;
+    lval *r = NULL;
+    if (vtype == LVAL_LONG)
+    {
+        r = lval_vector(LVAL_LONG, n);
+        lval *x = a->cell[0];
+        for (int i = 0; i < n; i++)
+        {
+            r->lngs[i] = unary ? 0 : x->type == LVAL_VECTOR ? x->lngs[i] : x->lng;
+        }
+
+        int ok = 1;
+        for (int j = unary ? 0 : 1; ok && j < a->count; j++)
+        {
+            lval *y = a->cell[j];
+            ok = y->type == LVAL_VECTOR ? vec_longs(r->lngs, y->lngs, 1, n, op)
+                                        : vec_longs(r->lngs, &y->lng, 0, n, op);
+        }
+        if (!ok)
+        {
+            lval_del(r);
+            r = NULL;
+        }
+    }
+    else if (vtype == LVAL_DOUBLE)
+    {
+        // mixed long and double promote every component, as eval_nums does
+        r = lval_vector(LVAL_DOUBLE, n);
+        double *ys = malloc(sizeof(double) * n);
+        int ok = 1;
+        for (int j = 0; ok && j < a->count; j++)
+        {
+            lval *y = a->cell[j];
+            int stride = y->type == LVAL_VECTOR;
+            for (int i = 0; i < (stride ? n : 1); i++)
+            {
+                ys[i] = !stride ? lval_to_double(y)
+                        : y->vtype == LVAL_LONG ? (double)y->lngs[i]
+                                                : y->dbls[i];
+            }
+
+            // unary minus negates directly, 0 - x would lose the sign of zero
+            if (j == 0)
+            {
+                for (int i = 0; i < n; i++)
+                {
+                    r->dbls[i] = unary ? -ys[i * stride] : ys[i * stride];
+                }
+                continue;
+            }
+            ok = vec_doubles(r->dbls, ys, stride, n, op);
+        }
+        free(ys);
+        if (!ok)
+        {
+            lval_del(r);
+            r = NULL;
+        }
+    }
+
+    if (r)
+    {
+        lval_del(a);
+        return r;
+    }
+
+    // boxed fallback, one scalar builtin_op per element
+    r = lval_qexpr();
+    for (int i = 0; i < n; i++)
+    {
+        lval *args = lval_sexpr();
+        for (int j = 0; j < a->count; j++)
+        {
+            args = lval_add(args, vector_arg_nth(a->cell[j], i));
+        }
+
+        lval *x = builtin_op(args, op);
+        if (x->type == LVAL_ERR)
+        {
+            lval_del(r);
+            lval_del(a);
+            return x;
+        }
+        r = lval_add(r, x);
+    }
+
+    lval_del(a);
+    return lval_pack(r);
+}
+
+lval *builtin_op(lval *a, char *op)
+{
+    // ensure args are nums, noting if they all share one type
+    int same = 1;
+    int vectors = 0;
+    for (int i = 0; i < a->count; i++)
+    {
+        int type = a->cell[i]->type;
+        if (!lval_is_num(a->cell[i]) && !lval_is_num_list(a->cell[i]))
+        {
+            lval_del(a);
+            return lval_err("cannot operate on non numbers");
+        }
+        same = same && type == a->cell[0]->type;
+        vectors = vectors || lval_is_qexpr(a->cell[i]);
+    }
+
+    if (vectors)
+    {
+        return vector_op(a, op);
+    }
+
+    if (same && a->count > 1)
+    {
+        lval *r = fold_nums(a, a->cell[0]->type, op);
+        if (r)
+        {
+            lval_del(a);
+            return r;
+        }
+    }
+
+    // pop first thing
+    lval *x = lval_unshare(lval_pop(a, 0));
+
+    // unary negation
+    if ((strcmp(op, "-") == 0) && a->count == 0)
+    {
+        if (x->type == LVAL_DOUBLE)
+        {
+            x->dbl = -x->dbl;
+        }
+        else if (x->type == LVAL_BIGNUM)
+        {
+            x->big->sign = -x->big->sign;
+        }
+        else if (x->lng == LONG_MIN)
+        {
+            lval_del(x);
+            bignum *b = big_from_long(LONG_MIN);
+            b->sign = 1;
+            x = lval_bignum(b);
+        }
+        else
+        {
+            x->lng = -x->lng;
+        }
+    }
+
+    for (int i = 0; i < a->count; i++)
+    {
+        lval *z = eval_nums(x, op, a->cell[i]);
+        lval_del(x);
+        x = z;
+
+        if (x->type == LVAL_ERR)
+        {
+            break;
+        }
+    }
+
+    lval_del(a);
+    return x;
+}
+
+lval *global_env = NULL;
+
+// point k at its slot as seen from scope s: depth counts frames outward and
+// globals get depth -1. a global that is not defined yet keeps slot -1 and
+// is looked up again when read, so names only ever seen as data never take
+// a slot in the global frame
+void lval_resolve_sym(scope *s, lval *k)
+{
+    int depth = 0;
+    int slot = -1;
+    for (scope *t = s; t != global_scope; t = t->parent, depth++)
+    {
+        slot = scope_find(t, k->sym);
+        if (slot >= 0)
+        {
+            break;
+        }
+    }
+    if (slot < 0)
+    {
+        depth = -1;
+        slot = scope_find(global_scope, k->sym);
+    }
+
+    s->ref++;
+    scope_release(k->scope);
+    k->scope = s;
+    k->epoch = scope_epoch;
+    k->depth = depth;
+    k->slot = slot;
+}
+
+int lval_is_lambda(lval *v)
+{
+    return v->count && v->cell[0]->type == LVAL_SYM &&
+           strcmp(v->cell[0]->sym, "\\") == 0;
+}
+
+void lval_resolve(scope *s, lval *v)
+{
+    if (v->type == LVAL_SYM)
+    {
+        lval_resolve_sym(s, v);
+        return;
+    }
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)
+    {
+        return;
+    }
+
+    // a lambda body is resolved against its own scope once it is built
+    int n = lval_is_lambda(v) ? 1 : v->count;
+    for (int i = 0; i < n; i++)
+    {
+        lval_resolve(s, v->cell[i]);
+    }
+}
+
+// give each name assigned with = in a body its slot before resolving it
+void scope_prescan(scope *s, lval *v)
+{
+    if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || lval_is_lambda(v))
+    {
+        return;
+    }
+
+    if (v->count > 1 && v->cell[0]->type == LVAL_SYM &&
+        strcmp(v->cell[0]->sym, "=") == 0 && v->cell[1]->type == LVAL_QEXPR)
+    {
+        lval *names = v->cell[1];
+        for (int i = 0; i < names->count; i++)
+        {
+            if (names->cell[i]->type == LVAL_SYM &&
+                scope_find(s, names->cell[i]->sym) < 0)
+            {
+                scope_add(s, names->cell[i]->sym);
+            }
+        }
+    }
+
+    for (int i = 0; i < v->count; i++)
+    {
+        scope_prescan(s, v->cell[i]);
+    }
+}
+
+lval *lenv_get(lval *e, lval *k)
+{
+    if (k->scope != e->scope || k->epoch != scope_epoch)
+    {
+        lval_resolve_sym(e->scope, k);
+    }
+
+    if (k->depth < 0 && k->slot < 0)
+    {
+        k->slot = scope_find(global_scope, k->sym);
+    }
+
+    lval *f = global_env;
+    if (k->depth >= 0)
+    {
+        f = e;
+        for (int i = 0; i < k->depth; i++)
+        {
+            f = f->env;
+        }
+    }
+
+    if (k->slot < 0 || k->slot >= f->count || f->cell[k->slot] == NULL)
+    {
+        return lval_err("unbound symbol");
+    }
+    return lval_copy(f->cell[k->slot]);
+}
+
+void lenv_set(lval *e, int slot, lval *v)
+{
+    if (slot >= e->count)
+    {
+        e->cell = realloc(e->cell, sizeof(lval *) * (slot + 1));
+        memset(&e->cell[e->count], 0, sizeof(lval *) * (slot + 1 - e->count));
+        e->count = slot + 1;
+    }
+    if (e->cell[slot])
+    {
+        lval_del(e->cell[slot]);
+    }
+    e->cell[slot] = v;
+}
+
+void lenv_def(char *name, lval *v)
+{
+    int slot = scope_find(global_scope, name);
+    if (slot < 0)
+    {
+        slot = scope_add(global_scope, name);
+    }
+    lenv_set(global_env, slot, v);
+}
+
+// bind name in the innermost frame, growing its scope if the name was not
+// seen when the lambda was built
+void lenv_put_local(lval *e, char *name, lval *v)
+{
+    int slot = scope_find(e->scope, name);
+    if (slot < 0)
+    {
+        slot = scope_add(e->scope, name);
+        scope_epoch++;
+    }
+    lenv_set(e, slot, v);
+}
+
+bcode *code_body(lval *v);
+
+lval *lval_lambda(lval *e, lval *formals, lval *body)
+{
+    lval *v = lval_alloc(LVAL_FUN);
+    v->fun = NULL;
+    v->formals = formals;
+    v->body = body;
+    v->env = lval_copy(e);
+    v->scope = scope_new(e->scope);
+
+    for (int i = 0; i < formals->count; i++)
+    {
+        if (strcmp(formals->cell[i]->sym, "&") != 0)
+        {
+            scope_add(v->scope, formals->cell[i]->sym);
+        }
+    }
+    scope_prescan(v->scope, body);
+    lval_resolve(v->scope, body);
+    v->code = code_body(body);
+    return v;
+}
+
+// a fresh frame for calling lambda f with arguments a
+lval *lval_bind(lval *f, lval *a)
+{
+    lval *frame = lval_frame(f->env, f->scope);
+    int slot = 0;
+    for (int i = 0; i < f->formals->count; i++)
+    {
+        lval *k = f->formals->cell[i];
+
+        // & binds whatever is left as a qexpr
+        if (strcmp(k->sym, "&") == 0)
+        {
+            a->type = LVAL_QEXPR;
+            lenv_set(frame, slot, lval_pack(a));
+            return frame;
+        }
+
+        if (a->count == 0)
+        {
+            lval_del(a);
+            lval_del(frame);
+            return lval_err("function passed too few arguments");
+        }
+        lenv_set(frame, slot++, lval_pop(a, 0));
+    }
+
+    int extra = a->count;
+    lval_del(a);
+    if (extra)
+    {
+        lval_del(frame);
+        return lval_err("function passed too many arguments");
+    }
+    return frame;
+}
+
+// bumped whenever a global holding a builtin is redefined, so code that
+// inlined a builtin can tell it may no longer be bound to that name
+int builtins_rebound = 0;
+
+// the global binding of name, or NULL
+lval *lenv_global(char *name)
+{
+    int slot = scope_find(global_scope, name);
+    if (slot < 0 || slot >= global_env->count)
+    {
+        return NULL;
+    }
+    return global_env->cell[slot];
+}
+
+lval *builtin_var(lval *e, lval *a, int local, char *func)
+{
+    LASSERT(a, a->count > 0 && lval_is_qexpr(a->cell[0]),
+            "variable names must be a qexpr");
+
+    // a packed qexpr only holds numbers
+    lval *names = a->cell[0];
+    LASSERT(a, names->type != LVAL_VECTOR || names->count == 0,
+            "cannot define non-symbol");
+    for (int i = 0; i < names->count; i++)
+    {
+        LASSERT(a, names->cell[i]->type == LVAL_SYM,
+                "cannot define non-symbol");
+    }
+
+    LASSERT(a, names->count == a->count - 1,
+            strcmp(func, "def") == 0 ? "def passed wrong number of values"
+                                     : "= passed wrong number of values");
+
+    for (int i = 0; i < names->count && !(local && e != global_env); i++)
+    {
+        lval *old = lenv_global(names->cell[i]->sym);
+        if (old && old->type == LVAL_FUN && old->fun)
+        {
+            builtins_rebound++;
+        }
+    }
+
+    for (int i = 0; i < names->count; i++)
+    {
+        lval *v = lval_copy(a->cell[i + 1]);
+        if (local && e != global_env)
+        {
+            lenv_put_local(e, names->cell[i]->sym, v);
+        }
+        else
+        {
+            lenv_def(names->cell[i]->sym, v);
+        }
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval *builtin_def(lval *e, lval *a)
+{
+    return builtin_var(e, a, 0, "def");
+}
+
+lval *builtin_put(lval *e, lval *a)
+{
+    return builtin_var(e, a, 1, "=");
+}
+
+lval *builtin_lambda(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 2,
+            "lambda passed wrong number of args");
+
+    LASSERT(a, lval_is_qexpr(a->cell[0]),
+            "lambda formals must be a qexpr");
+
+    LASSERT(a, lval_is_qexpr(a->cell[1]),
+            "lambda body must be a qexpr");
+
+    // a packed qexpr only holds numbers, so it is fine only when empty
+    lval *formals = a->cell[0];
+    LASSERT(a, formals->type != LVAL_VECTOR || formals->count == 0,
+            "cannot use non-symbol as formal");
+    for (int i = 0; i < formals->count && formals->type == LVAL_QEXPR; i++)
+    {
+        LASSERT(a, formals->cell[i]->type == LVAL_SYM,
+                "cannot use non-symbol as formal");
+    }
+
+    formals = lval_unpack(lval_pop(a, 0));
+    lval *body = lval_take(a, 0);
+    return lval_lambda(e, formals, body);
+}
+
+lval *builtin_add(lval *e, lval *a) { return builtin_op(a, "+"); }
+lval *builtin_sub(lval *e, lval *a) { return builtin_op(a, "-"); }
+lval *builtin_mul(lval *e, lval *a) { return builtin_op(a, "*"); }
+lval *builtin_div(lval *e, lval *a) { return builtin_op(a, "/"); }
+lval *builtin_mod(lval *e, lval *a) { return builtin_op(a, "%"); }
+lval *builtin_pow(lval *e, lval *a) { return builtin_op(a, "^"); }
+lval *builtin_min(lval *e, lval *a) { return builtin_op(a, "min"); }
+lval *builtin_max(lval *e, lval *a) { return builtin_op(a, "max"); }
+
+// the i-th item of a list, boxing packed numbers
+lval *lval_item(lval *v, int i)
+{
+    if (v->type == LVAL_VECTOR)
+    {
+        return v->vtype == LVAL_LONG ? lval_long(v->lngs[i]) : lval_double(v->dbls[i]);
+    }
+    return lval_copy(v->cell[i]);
+}
+
+int lval_is_num(lval *v)
+{
+    return v->type == LVAL_LONG || v->type == LVAL_DOUBLE || v->type == LVAL_BIGNUM;
+}
+
+int lval_num_cmp(lval *x, lval *y)
+{
+    if (x->type == LVAL_LONG && y->type == LVAL_LONG)
+    {
+        return (x->lng > y->lng) - (x->lng < y->lng);
+    }
+    if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE)
+    {
+        double a = lval_to_double(x);
+        double b = lval_to_double(y);
+        return (a > b) - (a < b);
+    }
+
+    bignum *a = x->type == LVAL_BIGNUM ? x->big : big_from_long(x->lng);
+    bignum *b = y->type == LVAL_BIGNUM ? y->big : big_from_long(y->lng);
+    int r = big_cmp(a, b);
+    if (a != x->big)
+    {
+        big_del(a);
+    }
+    if (b != y->big)
+    {
+        big_del(b);
+    }
+    return r;
+}
+
+int lval_eq(lval *x, lval *y)
+{
+    if (x == y)
+    {
+        return 1;
+    }
+    if (lval_is_num(x) && lval_is_num(y))
+    {
+        return lval_num_cmp(x, y) == 0;
+    }
+    if (lval_is_qexpr(x) && lval_is_qexpr(y))
+    {
+        if (x->count != y->count)
+        {
+            return 0;
+        }
+        for (int i = 0; i < x->count; i++)
+        {
+            lval *a = lval_item(x, i);
+            lval *b = lval_item(y, i);
+            int eq = lval_eq(a, b);
+            lval_del(a);
+            lval_del(b);
+            if (!eq)
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (x->type != y->type)
+    {
+        return 0;
+    }
+
+    switch (x->type)
+    {
+    case LVAL_SYM:
+        return strcmp(x->sym, y->sym) == 0;
+    case LVAL_ERR:
+        return strcmp(x->err, y->err) == 0;
+    case LVAL_SEXPR:
+        if (x->count != y->count)
+        {
+            return 0;
+        }
+        for (int i = 0; i < x->count; i++)
+        {
+            if (!lval_eq(x->cell[i], y->cell[i]))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return x == y;
+}
+
+lval *builtin_cmp(lval *a, char *op)
+{
+    LASSERT(a, a->count == 2,
+            "comparison passed wrong number of args");
+
+    lval *x = a->cell[0];
+    lval *y = a->cell[1];
+    int r;
+    if (strcmp(op, "==") == 0 || strcmp(op, "!=") == 0)
+    {
+        r = lval_eq(x, y) == (op[0] == '=');
+    }
+    else
+    {
+        LASSERT(a, lval_is_num(x) && lval_is_num(y),
+                "cannot compare non numbers");
+
+        int c = lval_num_cmp(x, y);
+        r = op[0] == '<' ? (op[1] ? c <= 0 : c < 0) : (op[1] ? c >= 0 : c > 0);
+    }
+
+    lval_del(a);
+    return lval_long(r);
+}
+
+lval *builtin_eq(lval *e, lval *a) { return builtin_cmp(a, "=="); }
+lval *builtin_ne(lval *e, lval *a) { return builtin_cmp(a, "!="); }
+lval *builtin_lt(lval *e, lval *a) { return builtin_cmp(a, "<"); }
+lval *builtin_gt(lval *e, lval *a) { return builtin_cmp(a, ">"); }
+lval *builtin_le(lval *e, lval *a) { return builtin_cmp(a, "<="); }
+lval *builtin_ge(lval *e, lval *a) { return builtin_cmp(a, ">="); }
+
+// hands back the chosen branch, which the evaluator runs in tail position
+lval *builtin_if(lval *e, lval *a)
+{
+    LASSERT(a, a->count == 3,
+            "if passed wrong number of args");
+
+    LASSERT(a, lval_is_num(a->cell[0]),
+            "if passed non-number condition");
+
+    LASSERT(a, lval_is_qexpr(a->cell[1]) && lval_is_qexpr(a->cell[2]),
+            "if passed non-qexpr branch");
+
+    lval *c = a->cell[0];
+    int truth = c->type == LVAL_DOUBLE ? c->dbl != 0
+                : c->type == LVAL_LONG ? c->lng != 0
+                                       : 1;
+
+    lval *x = lval_unpack(lval_unshare(lval_take(a, truth ? 1 : 2)));
+    x->type = LVAL_SEXPR;
+    return x;
+}
+
+// conditionals and comparisons, a language addition separate from the
+// environment itself. user functions need them to stop recursing, and the
+// tail calls, VM and JIT built on top of environments assume they exist
+void lenv_init_control(void)
+{
+    lenv_def("if", lval_builtin(builtin_if));
+
+    lenv_def("==", lval_builtin(builtin_eq));
+    lenv_def("!=", lval_builtin(builtin_ne));
+    lenv_def("<", lval_builtin(builtin_lt));
+    lenv_def(">", lval_builtin(builtin_gt));
+    lenv_def("<=", lval_builtin(builtin_le));
+    lenv_def(">=", lval_builtin(builtin_ge));
+}
+
+void lenv_init(void)
+{
+    global_scope = scope_new(NULL);
+    global_scope->index_cap = 64;
+    global_scope->index = calloc(global_scope->index_cap, sizeof(int));
+    global_env = lval_frame(NULL, global_scope);
+    gc_root(global_env);
+
+    lenv_def("list", lval_builtin(builtin_list));
+    lenv_def("head", lval_builtin(builtin_head));
+    lenv_def("tail", lval_builtin(builtin_tail));
+    lenv_def("join", lval_builtin(builtin_join));
+    lenv_def("eval", lval_builtin(builtin_eval));
+    lenv_def("cons", lval_builtin(builtin_cons));
+    lenv_def("init", lval_builtin(builtin_init));
+    lenv_def("len", lval_builtin(builtin_len));
+
+    lenv_def("def", lval_builtin(builtin_def));
+    lenv_def("=", lval_builtin(builtin_put));
+    lenv_def("\\", lval_builtin(builtin_lambda));
+
+    lenv_def("+", lval_builtin(builtin_add));
+    lenv_def("-", lval_builtin(builtin_sub));
+    lenv_def("*", lval_builtin(builtin_mul));
+    lenv_def("/", lval_builtin(builtin_div));
+    lenv_def("%", lval_builtin(builtin_mod));
+    lenv_def("^", lval_builtin(builtin_pow));
+    lenv_def("min", lval_builtin(builtin_min));
+    lenv_def("max", lval_builtin(builtin_max));
+
+    lenv_init_control();
+}
+
+// builtins whose result is an expression still to be evaluated in the
+// caller's frame, so eval and if never grow the continuation stack
+int builtin_is_tail(lbuiltin f)
+{
+    return f == builtin_eval || f == builtin_if;
+}
+
+void eval_push(lval *e, lval *v)
+{
+    if (eval_count == eval_cap)
+    {
+        eval_cap = eval_cap ? eval_cap * 2 : 64;
+        eval_stack = realloc(eval_stack, sizeof(cont) * eval_cap);
+    }
+    eval_stack[eval_count].env = lval_copy(e);
+    eval_stack[eval_count].expr = v;
+    eval_stack[eval_count].i = 0;
+    eval_count++;
+}
+
+// collect in the middle of the outermost evaluation, where nothing but the
+// continuations and the expression in hand are live
+void eval_safepoint(lval *e, lval *x)
+{
+    if (eval_depth == 1 && gc_live > gc_threshold)
+    {
+        gc_root(e);
+        gc_root(x);
+        gc_collect();
+        gc_unroot(x);
+        gc_unroot(e);
+    }
+}
+
+int builtin_is_pure(lbuiltin f)
+{
+    return f == builtin_add || f == builtin_sub || f == builtin_mul ||
+           f == builtin_div || f == builtin_mod || f == builtin_min ||
+           f == builtin_max || f == builtin_len || f == builtin_head ||
+           f == builtin_tail || f == builtin_join || f == builtin_list;
+}
+
+// builtins whose result depends only on their arguments
+int builtin_is_memo(lbuiltin f)
+{
+    return builtin_is_pure(f) || f == builtin_pow || f == builtin_cons ||
+           f == builtin_init || f == builtin_eq || f == builtin_ne ||
+           f == builtin_lt || f == builtin_gt || f == builtin_le || f == builtin_ge;
+}
+
+// opt-in result cache for pure builtins, keyed by a structural hash of
+// the builtin and its evaluated arguments. entries sit on an LRU list with
+// the most recently used first, the tail is evicted once memo_cap is hit.
+unsigned long lval_hash_deep(lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    {
+        unsigned long h = hc_mix(0xcbf29ce484222325ul, v->type);
+        for (int i = 0; i < v->count; i++)
+        {
+            h = hc_mix(h, lval_hash_deep(v->cell[i]));
+        }
+        return hc_mix(h, v->count);
+    }
+    case LVAL_ERR:
+        return hc_mix(v->type, str_hash(v->err));
+    case LVAL_FUN:
+    case LVAL_ENV:
+        return hc_mix(v->type, (uintptr_t)v);
+    }
+    return lval_hash(v);
+}
+
+memo_entry *memo_find(unsigned long h, lbuiltin f, lval *a)
+{
+    for (memo_entry *m = memo_buckets[h & (memo_nbuckets - 1)]; m; m = m->chain)
+    {
+        if (m->hash == h && m->fun == f && lval_identical(m->args, a, 1))
+        {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+void memo_unlink(memo_entry *m)
+{
+    if (m->prev)
+    {
+        m->prev->next = m->next;
+    }
+    else
+    {
+        memo_head = m->next;
+    }
+    if (m->next)
+    {
+        m->next->prev = m->prev;
+    }
+    else
+    {
+        memo_tail = m->prev;
+    }
+}
+
+void memo_link(memo_entry *m)
+{
+    m->prev = NULL;
+    m->next = memo_head;
+    if (memo_head)
+    {
+        memo_head->prev = m;
+    }
+    memo_head = m;
+    if (memo_tail == NULL)
+    {
+        memo_tail = m;
+    }
+}
+
+// reuse the least recently used entry, dropping it from its bucket
+memo_entry *memo_evict(void)
+{
+    memo_entry *m = memo_tail;
+    memo_unlink(m);
+
+    memo_entry **p = &memo_buckets[m->hash & (memo_nbuckets - 1)];
+    while (*p != m)
+    {
+        p = &(*p)->chain;
+    }
+    *p = m->chain;
+
+    lval_del(m->args);
+    lval_del(m->result);
+    memo_evictions++;
+    return m;
+}
+
+void memo_insert(unsigned long h, lbuiltin f, lval *args, lval *result)
+{
+    memo_entry *m = memo_count < memo_cap ? &memo_entries[memo_count++] : memo_evict();
+    m->hash = h;
+    m->fun = f;
+    m->args = args;
+    m->result = result;
+    m->chain = memo_buckets[h & (memo_nbuckets - 1)];
+    memo_buckets[h & (memo_nbuckets - 1)] = m;
+    memo_link(m);
+}
+
+// whether v holds at most *budget values, counting nested lists, with the
+// count taken off *budget. stops as soon as the budget runs out
+int memo_small(lval *v, int *budget)
+{
+    *budget -= v->type == LVAL_VECTOR ? v->count : 1;
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+    {
+        for (int i = 0; i < v->count && *budget >= 0; i++)
+        {
+            memo_small(v->cell[i], budget);
+        }
+    }
+    return *budget >= 0;
+}
+
+lval *memo_call(lval *e, lbuiltin f, lval *a)
+{
+    // hashing and copying a key costs as much as the arguments are big, so
+    // calls on long lists go straight through and list steps stay O(1)
+    int budget = MEMO_MAX_CELLS;
+    if (!memo_small(a, &budget))
+    {
+        return f(e, a);
+    }
+
+    if (memo_entries == NULL)
+    {
+        memo_entries = malloc(sizeof(memo_entry) * memo_cap);
+        for (memo_nbuckets = 1; memo_nbuckets < memo_cap * 2; memo_nbuckets *= 2)
+        {
+        }
+        memo_buckets = calloc(memo_nbuckets, sizeof(memo_entry *));
+    }
+
+    unsigned long h = hc_mix(lval_hash_deep(a), (uintptr_t)f);
+    memo_entry *m = memo_find(h, f, a);
+    if (m)
+    {
+        memo_hits++;
+        memo_unlink(m);
+        memo_link(m);
+        lval_del(a);
+        return lval_copy(m->result);
+    }
+
+    // the builtin consumes a, the key keeps a private header on its items
+    memo_misses++;
+    lval *args = lval_clone(a);
+    lval *r = f(e, a);
+    memo_insert(h, f, args, lval_copy(r));
+    return r;
+}
+
+void memo_stats(void)
+{
+    fprintf(stderr, "memo: %ld hits, %ld misses, %ld evictions, %d entries\n",
+            memo_hits, memo_misses, memo_evictions, memo_count);
+}
+
+// bytecode compiler. lambda bodies, and expressions handed back by eval
+// and if while in the VM, are compiled into a flat instruction stream for
+// a stack machine. lookups still go through lenv_get, so the code stays
+// valid however the scopes change. the superinstructions check at run
+// time that their builtin is still what the symbol names and otherwise
+// fall through into the generic call that follows them.
+int code_const(bcode *c, lval *v)
+{
+    if (c->nconsts == c->consts_cap)
+    {
+        c->consts_cap = c->consts_cap ? c->consts_cap * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval *) * c->consts_cap);
+    }
+    c->consts[c->nconsts] = lval_copy(v);
+    return c->nconsts++;
+}
+
+void code_emit(bcode *c, int x)
+{
+    if (c->count == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 32;
+        c->ops = realloc(c->ops, sizeof(int) * c->cap);
+    }
+    c->ops[c->count++] = x;
+}
+
+// start an instruction, remembering it for the const/const peephole
+void code_op(bcode *c, int op)
+{
+    c->last = c->count;
+    code_emit(c, op);
+}
+
+// a jump target, nothing before it may be merged with what follows
+int code_label(bcode *c)
+{
+    c->last = -1;
+    return c->count;
+}
+
+void code_push_const(bcode *c, lval *v)
+{
+    int k = code_const(c, v);
+    if (c->last >= 0 && c->ops[c->last] == OP_CONST)
+    {
+        c->ops[c->last] = OP_CONST2;
+        code_emit(c, k);
+        c->last = -1;
+        return;
+    }
+    code_op(c, OP_CONST);
+    code_emit(c, k);
+}
+
+void code_call(bcode *c, int n, int tail)
+{
+    code_op(c, tail ? OP_TAILCALL : OP_CALL);
+    code_emit(c, n);
+}
+
+int lval_is_sym(lval *v, char *name)
+{
+    return v->type == LVAL_SYM && strcmp(v->sym, name) == 0;
+}
+
+void code_list(bcode *c, lval *v, int tail);
+
+lval *code_fold(lval *v);
+
+// the value of an argument known while compiling, or NULL
+lval *code_fold_arg(lval *v)
+{
+    if (lval_is_num(v) || lval_is_qexpr(v))
+    {
+        return lval_copy(v);
+    }
+    return v->type == LVAL_SEXPR ? code_fold(v) : NULL;
+}
+
+// the result of v if it calls a global pure builtin on constants, or NULL.
+// quoted data is only ever an argument, it is never folded into. calls that
+// fail are left for the evaluator to report.
+lval *code_fold(lval *v)
+{
+    if (v->type == LVAL_VECTOR || v->count < 2)
+    {
+        return NULL;
+    }
+    lval *k = v->cell[0];
+    if (k->type != LVAL_SYM || !k->scope || k->depth >= 0)
+    {
+        return NULL;
+    }
+    lval *f = lenv_global(k->sym);
+    if (!f || f->type != LVAL_FUN || !f->fun || !builtin_is_pure(f->fun))
+    {
+        return NULL;
+    }
+
+    lval *a = lval_sexpr();
+    for (int i = 1; i < v->count; i++)
+    {
+        lval *x = code_fold_arg(v->cell[i]);
+        if (!x)
+        {
+            lval_del(a);
+            return NULL;
+        }
+        a = lval_add(a, x);
+    }
+
+    lval *r = f->fun(global_env, a);
+    if (r->type == LVAL_ERR)
+    {
+        lval_del(r);
+        return NULL;
+    }
+    return r;
+}
+
+int arith_op(lval *v)
+{
+    for (int i = 0; v->type == LVAL_SYM && i < ARITH_COUNT; i++)
+    {
+        if (strcmp(v->sym, arith_names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void code_expr(bcode *c, lval *v, int tail)
+{
+    if (v->type == LVAL_SYM)
+    {
+        code_op(c, OP_LOAD);
+        code_emit(c, code_const(c, v));
+    }
+    else if (v->type == LVAL_SEXPR)
+    {
+        code_list(c, v, tail);
+    }
+    else
+    {
+        code_push_const(c, v);
+    }
+}
+
+// code for evaluating the items of v as an S-expression
+void code_list(bcode *c, lval *v, int tail)
+{
+    if (v->count == 0)
+    {
+        lval *x = lval_sexpr();
+        code_push_const(c, x);
+        lval_del(x);
+        return;
+    }
+
+    if (v->count == 1)
+    {
+        lval *x = lval_item(v, 0);
+        code_expr(c, x, tail);
+        lval_del(x);
+        return;
+    }
+
+    if (v->type == LVAL_VECTOR)
+    {
+        for (int i = 0; i < v->count; i++)
+        {
+            lval *x = lval_item(v, i);
+            code_push_const(c, x);
+            lval_del(x);
+        }
+        code_call(c, v->count, tail);
+        return;
+    }
+
+    lval **x = v->cell;
+
+    // a pure call on constants in a lambda body is worked out once, here
+    lval *folded = c->fold ? code_fold(v) : NULL;
+    if (folded)
+    {
+        code_op(c, OP_FOLDED);
+        code_emit(c, code_const(c, folded));
+        code_emit(c, builtins_rebound);
+        code_emit(c, scope_epoch);
+        int at = c->count;
+        code_emit(c, 0);
+        lval_del(folded);
+
+        code_label(c);
+        c->fold = 0;
+        code_list(c, v, tail);
+        c->fold = 1;
+        c->ops[at] = code_label(c);
+        return;
+    }
+
+    // (if cond {then} {else}) branches inline
+    if (v->count == 4 && lval_is_sym(x[0], "if") && lval_is_qexpr(x[2]) && lval_is_qexpr(x[3]))
+    {
+        code_expr(c, x[1], 0);
+        code_op(c, OP_IF);
+        code_emit(c, code_const(c, x[0]));
+        code_emit(c, code_const(c, x[2]));
+        code_emit(c, code_const(c, x[3]));
+        code_emit(c, tail);
+        int at = c->count;
+        code_emit(c, 0);
+        code_emit(c, 0);
+
+        code_label(c);
+        code_list(c, x[2], tail);
+        code_op(c, OP_JMP);
+        int jmp = c->count;
+        code_emit(c, 0);
+
+        c->ops[at] = code_label(c);
+        code_list(c, x[3], tail);
+        c->ops[jmp] = c->ops[at + 1] = code_label(c);
+        return;
+    }
+
+    // (head (tail xs))
+    if (v->count == 2 && lval_is_sym(x[0], "head") && x[1]->type == LVAL_SEXPR &&
+        x[1]->count == 2 && lval_is_sym(x[1]->cell[0], "tail"))
+    {
+        code_expr(c, x[1]->cell[1], 0);
+        code_op(c, OP_HEAD_TAIL);
+        code_emit(c, code_const(c, x[0]));
+        code_emit(c, code_const(c, x[1]->cell[0]));
+        code_call(c, 2, 0);
+        code_call(c, 2, tail);
+        return;
+    }
+
+    if (v->count == 3 && lval_is_sym(x[0], "+") &&
+        x[1]->type == LVAL_LONG && x[2]->type == LVAL_LONG)
+    {
+        code_op(c, OP_CONST2_ADD);
+        code_emit(c, code_const(c, x[1]));
+        code_emit(c, code_const(c, x[2]));
+        code_emit(c, code_const(c, x[0]));
+        code_call(c, 3, tail);
+        return;
+    }
+
+    // arithmetic starts unspecialised and quickens on its first run
+    int op = arith_op(x[0]);
+    if (v->count >= 3 && op >= 0)
+    {
+        for (int i = 1; i < v->count; i++)
+        {
+            code_expr(c, x[i], 0);
+        }
+        code_op(c, OP_ARITH);
+        code_emit(c, code_const(c, x[0]));
+        code_emit(c, op);
+        code_emit(c, v->count - 1);
+        code_call(c, v->count, tail);
+        return;
+    }
+
+    for (int i = 0; i < v->count; i++)
+    {
+        code_expr(c, x[i], 0);
+    }
+    code_call(c, v->count, tail);
+}
+
+bcode *code_new(void)
+{
+    bcode *c = calloc(1, sizeof(bcode));
+    c->ref = 1;
+    c->last = -1;
+    return c;
+}
+
+// compile v for evaluation as an S-expression body, folding constant calls
+// since a lambda body is compiled once and run many times
+bcode *code_body(lval *v)
+{
+    bcode *c = code_new();
+    c->fold = 1;
+    code_list(c, v, 1);
+    code_op(c, OP_RET);
+    return c;
+}
+
+// compile a single expression handed back by eval or if, consuming it
+bcode *code_expr_of(lval *v)
+{
+    bcode *c = code_new();
+    code_expr(c, v, 1);
+    code_op(c, OP_RET);
+    lval_del(v);
+    return c;
+}
+
+void vm_push(lval *v)
+{
+    if (vm_sp == vm_stack_cap)
+    {
+        vm_stack_cap = vm_stack_cap ? vm_stack_cap * 2 : 256;
+        vm_stack = realloc(vm_stack, sizeof(lval *) * vm_stack_cap);
+    }
+    vm_stack[vm_sp++] = v;
+}
+
+// open a slot below the top n values, used when a superinstruction has to
+// fall back to a generic call that wants the function underneath
+void vm_insert(int n, lval *v)
+{
+    vm_push(NULL);
+    memmove(&vm_stack[vm_sp - n], &vm_stack[vm_sp - n - 1], sizeof(lval *) * n);
+    vm_stack[vm_sp - n - 1] = v;
+}
+
+void vm_push_frame(lval *env, bcode *code)
+{
+    if (vm_fcount == vm_fcap)
+    {
+        vm_fcap = vm_fcap ? vm_fcap * 2 : 64;
+        vm_frames = realloc(vm_frames, sizeof(vm_frame) * vm_fcap);
+    }
+    vm_frames[vm_fcount].env = env;
+    vm_frames[vm_fcount].code = code;
+    vm_frames[vm_fcount].pc = 0;
+    vm_fcount++;
+}
+
+void vm_safepoint(void)
+{
+    if (vm_depth == 1 && eval_depth == 1 && gc_live > gc_threshold)
+    {
+        gc_collect();
+    }
+}
+
+int lval_truth(lval *c)
+{
+    return c->type == LVAL_DOUBLE ? c->dbl != 0
+           : c->type == LVAL_LONG ? c->lng != 0
+                                  : 1;
+}
+
+lbuiltin arith_builtins[] = {builtin_add, builtin_sub, builtin_mul, builtin_div,
+                             builtin_mod, builtin_min, builtin_max};
+
+int arith_all(lval **xs, int n, int type)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (xs[i]->type != type)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the fast paths of a quickened site. NULL hands the call to builtin_op,
+// which deals with overflow and errors
+lval *arith_longs(int op, lval **xs, int n)
+{
+    long acc = xs[0]->lng;
+    for (int i = 1; i < n; i++)
+    {
+        long y = xs[i]->lng;
+        switch (op)
+        {
+        case ARITH_ADD:
+            if (long_add_overflow(acc, y, &acc))
+            {
+                return NULL;
+            }
+            break;
+        case ARITH_SUB:
+            if (long_sub_overflow(acc, y, &acc))
+            {
+                return NULL;
+            }
+            break;
+        case ARITH_MUL:
+            if (long_mul_overflow(acc, y, &acc))
+            {
+                return NULL;
+            }
+            break;
+        case ARITH_DIV:
+            if (y == 0 || (acc == LONG_MIN && y == -1))
+            {
+                return NULL;
+            }
+            acc /= y;
+            break;
+        case ARITH_MOD:
+            if (y == 0)
+            {
+                return NULL;
+            }
+            acc = y == -1 ? 0 : acc % y;
+            break;
+        case ARITH_MIN:
+            acc = acc > y ? y : acc;
+            break;
+        case ARITH_MAX:
+            acc = acc > y ? acc : y;
+            break;
+        }
+    }
+    return lval_long(acc);
+}
+
+lval *arith_doubles(int op, lval **xs, int n)
+{
+    double acc = xs[0]->dbl;
+    for (int i = 1; i < n; i++)
+    {
+        double y = xs[i]->dbl;
+        switch (op)
+        {
+        case ARITH_ADD:
+            acc += y;
+            break;
+        case ARITH_SUB:
+            acc -= y;
+            break;
+        case ARITH_MUL:
+            acc *= y;
+            break;
+        case ARITH_DIV:
+            if (y == 0)
+            {
+                return NULL;
+            }
+            acc /= y;
+            break;
+        case ARITH_MIN:
+            acc = acc > y ? y : acc;
+            break;
+        case ARITH_MAX:
+            acc = acc > y ? acc : y;
+            break;
+        default:
+            return NULL;
+        }
+    }
+    return lval_double(acc);
+}
+
+// baseline JIT for x86-64. a lambda whose body is nothing but + - * / %
+// min max over its formals and long literals is compiled to native code
+// once it has been called JIT_HOT times with --jit. the native function
+// takes the arguments as longs and returns nonzero whenever the exact
+// answer needs the interpreter (overflow, division by zero or by -1),
+// which then runs the call as usual.
+#define JIT_HOT 64
+#define JIT_MAX_ARGS 16
+
+int jit_enabled = 0;
+
+#ifdef CLISP_JIT
+
+typedef struct jit_buf
+{
+    unsigned char *code;
+    int count;
+    int cap;
+    int *bails;
+    int nbails;
+    int bails_cap;
+} jit_buf;
+
+void jit_bytes(jit_buf *j, const char *bytes, int n)
+{
+    if (j->count + n + 8 > j->cap)
+    {
+        j->cap = j->cap ? j->cap * 2 : 256;
+        j->code = realloc(j->code, j->cap);
+    }
+    memcpy(&j->code[j->count], bytes, n);
+    j->count += n;
+}
+
+// emit a jump to the bail out path, patched once its address is known
+void jit_bail_if(jit_buf *j, unsigned char cc)
+{
+    char op[2] = {0x0f, (char)(0x80 | cc)};
+    int32_t rel = 0;
+    jit_bytes(j, op, 2);
+    if (j->nbails == j->bails_cap)
+    {
+        j->bails_cap = j->bails_cap ? j->bails_cap * 2 : 16;
+        j->bails = realloc(j->bails, sizeof(int) * j->bails_cap);
     }
+    j->bails[j->nbails++] = j->count;
+    jit_bytes(j, (char *)&rel, 4);
+}
 
-    return lval_err("bad operator bro");
+#define JIT_CC_O 0x0
+#define JIT_CC_E 0x4
+
+// slot of formal k, or -1 if the name means something else in the body
+int jit_formal(lval *f, lval *k)
+{
+    for (int i = 0; i < f->formals->count; i++)
+    {
+        if (strcmp(f->formals->cell[i]->sym, k->sym) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
 }
 
-lval *eval_doubles(double x, char *op, double y)
+// an operator the body may use: not shadowed by any enclosing scope, and
+// globally bound to its builtin when compiled. jit_call retires the code
+// if a builtin is redefined later
+int jit_op(lval *f, lval *k)
 {
-    if (strcmp(op, "+") == 0)
+    int op = arith_op(k);
+    if (op < 0)
     {
-        return lval_double(x + y);
+        return -1;
     }
-    if (strcmp(op, "-") == 0)
+    for (scope *s = f->scope; s != global_scope; s = s->parent)
     {
-        return lval_double(x - y);
+        if (scope_find(s, k->sym) >= 0)
+        {
+            return -1;
+        }
     }
-    if (strcmp(op, "*") == 0)
+    lval *g = lenv_global(k->sym);
+    return g && g->type == LVAL_FUN && g->fun == arith_builtins[op] ? op : -1;
+}
+
+// code leaving the value of v in rax, 0 if v cannot be compiled. only the
+// body itself is a qexpr, nested calls are S-expressions
+int jit_expr(jit_buf *j, lval *f, lval *v, int body)
+{
+    if (v->type == LVAL_LONG)
     {
-        return lval_double(x * y);
+        jit_bytes(j, "\x48\xb8", 2); // mov rax, imm64
+        jit_bytes(j, (char *)&v->lng, 8);
+        return 1;
     }
-    if (strcmp(op, "/") == 0)
+    if (v->type == LVAL_SYM)
     {
-        if (y == 0)
+        int32_t slot = jit_formal(f, v);
+        if (slot < 0)
         {
-            return lval_err("divide by zero");
+            return 0;
         }
-        return lval_double(x / y);
+        slot *= 8;
+        jit_bytes(j, "\x48\x8b\x87", 3); // mov rax, [rdi + disp32]
+        jit_bytes(j, (char *)&slot, 4);
+        return 1;
     }
-    if (strcmp(op, "min") == 0)
+    if (v->type != (body ? LVAL_QEXPR : LVAL_SEXPR) || v->count < 3)
     {
-        return lval_double(x > y ? y : x);
+        return 0;
     }
-    if (strcmp(op, "max") == 0)
+
+    int op = jit_op(f, v->cell[0]);
+    if (op < 0 || !jit_expr(j, f, v->cell[1], 0))
     {
-        return lval_double(x > y ? x : y);
+        return 0;
     }
+    for (int i = 2; i < v->count; i++)
+    {
+        jit_bytes(j, "\x50", 1); // push rax
+        if (!jit_expr(j, f, v->cell[i], 0))
+        {
+            return 0;
+        }
+        jit_bytes(j, "\x48\x89\xc1\x58", 4); // mov rcx, rax; pop rax
 
-    return lval_err("bad operator bro");
+        switch (op)
+        {
+        case ARITH_ADD:
+            jit_bytes(j, "\x48\x01\xc8", 3); // add rax, rcx
+            jit_bail_if(j, JIT_CC_O);
+            break;
+        case ARITH_SUB:
+            jit_bytes(j, "\x48\x29\xc8", 3); // sub rax, rcx
+            jit_bail_if(j, JIT_CC_O);
+            break;
+        case ARITH_MUL:
+            jit_bytes(j, "\x48\x0f\xaf\xc1", 4); // imul rax, rcx
+            jit_bail_if(j, JIT_CC_O);
+            break;
+        case ARITH_DIV:
+        case ARITH_MOD:
+            jit_bytes(j, "\x48\x85\xc9", 3); // test rcx, rcx
+            jit_bail_if(j, JIT_CC_E);
+            jit_bytes(j, "\x48\x83\xf9\xff", 4); // cmp rcx, -1
+            jit_bail_if(j, JIT_CC_E);
+            jit_bytes(j, "\x48\x99\x48\xf7\xf9", 5); // cqo; idiv rcx
+            if (op == ARITH_MOD)
+            {
+                jit_bytes(j, "\x48\x89\xd0", 3); // mov rax, rdx
+            }
+            break;
+        case ARITH_MIN:
+            jit_bytes(j, "\x48\x39\xc8\x48\x0f\x4f\xc1", 7); // cmp rax, rcx; cmovg rax, rcx
+            break;
+        case ARITH_MAX:
+            jit_bytes(j, "\x48\x39\xc8\x48\x0f\x4c\xc1", 7); // cmp rax, rcx; cmovl rax, rcx
+            break;
+        }
+    }
+    return 1;
 }
 
-lval *lval_pop(lval *v, int i)
+int jit_cpu_ok(void)
 {
-    lval *x = v->cell[i];
+    static int ok = -1;
+    if (ok < 0)
+    {
+        unsigned int a, b, c, d;
+        ok = __get_cpuid(1, &a, &b, &c, &d) && (d & (1u << 15)); // cmov
+    }
+    return ok;
+}
 
-    memmove(&v->cell[i], &v->cell[i + 1],
-            sizeof(lval *) * (v->count - i - 1));
+void jit_compile(lval *f)
+{
+    bcode *c = f->code;
+    c->jit_state = -1;
 
-    v->count--;
+    if (!jit_cpu_ok() || f->formals->count > JIT_MAX_ARGS)
+    {
+        return;
+    }
+    for (int i = 0; i < f->formals->count; i++)
+    {
+        if (strcmp(f->formals->cell[i]->sym, "&") == 0)
+        {
+            return;
+        }
+    }
+
+    jit_buf j = {0};
+    jit_bytes(&j, "\x55\x48\x89\xe5", 4); // push rbp; mov rbp, rsp
+    if (!jit_expr(&j, f, f->body, 1))
+    {
+        free(j.code);
+        free(j.bails);
+        return;
+    }
+    // mov [rsi], rax; mov rsp, rbp; pop rbp; xor eax, eax; ret
+    jit_bytes(&j, "\x48\x89\x06\x48\x89\xec\x5d\x31\xc0\xc3", 10);
+    int bail = j.count;
+    // mov rsp, rbp; pop rbp; mov eax, 1; ret
+    jit_bytes(&j, "\x48\x89\xec\x5d\xb8\x01\x00\x00\x00\xc3", 10);
+    for (int i = 0; i < j.nbails; i++)
+    {
+        int32_t rel = bail - (j.bails[i] + 4);
+        memcpy(&j.code[j.bails[i]], &rel, 4);
+    }
+
+    // written while writable, then flipped to executable
+    size_t size = (j.count + 4095) & ~(size_t)4095;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+    {
+        memcpy(mem, j.code, j.count);
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0)
+        {
+            c->jit = (jit_fn)mem;
+            c->jit_size = size;
+            c->jit_state = 1;
+            c->jit_rebound = builtins_rebound;
+        }
+        else
+        {
+            munmap(mem, size);
+        }
+    }
+    free(j.code);
+    free(j.bails);
+}
+
+void jit_release(bcode *c)
+{
+    if (c->jit)
+    {
+        munmap((void *)c->jit, c->jit_size);
+    }
+}
+
+#else
+
+void jit_compile(lval *f)
+{
+    f->code->jit_state = -1;
+}
+
+void jit_release(bcode *c)
+{
+}
+
+#endif
+
+// run lambda f natively on a if it has been compiled, NULL leaves the call
+// and a to the interpreter
+lval *jit_call(lval *f, lval *a)
+{
+    bcode *c = f->code;
+    if (c->jit_state == 0 && ++c->calls >= JIT_HOT)
+    {
+        jit_compile(f);
+    }
+    // the native code inlined the arithmetic builtins, retire it for good
+    // once any builtin has been redefined
+    if (c->jit_state == 1 && c->jit_rebound != builtins_rebound)
+    {
+        c->jit_state = -1;
+    }
+    if (c->jit_state != 1 || a->count != f->formals->count)
+    {
+        return NULL;
+    }
+
+    long xs[JIT_MAX_ARGS];
+    for (int i = 0; i < a->count; i++)
+    {
+        if (a->cell[i]->type != LVAL_LONG)
+        {
+            return NULL;
+        }
+        xs[i] = a->cell[i]->lng;
+    }
+
+    long r;
+    if (c->jit(xs, &r))
+    {
+        return NULL;
+    }
+    lval_del(a);
+    return lval_long(r);
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CLISP_SWITCH_DISPATCH)
+#define VM_THREADED
+#endif
+
+#ifdef VM_THREADED
+#define VM_OP(name) op_##name
+#define VM_NEXT() goto *vm_labels[ops[pc++]]
+#else
+#define VM_OP(name) case name
+#define VM_NEXT() continue
+#endif
+
+// run code in env, which is consumed, until its frame returns. calls to
+// lambdas push a vm_frame rather than recursing, tail calls replace the
+// current one, so only the value stack and frame array grow.
+lval *vm_run(lval *env, bcode *code)
+{
+#ifdef VM_THREADED
+    static void *vm_labels[] = {
+        &&op_OP_CONST, &&op_OP_CONST2, &&op_OP_LOAD, &&op_OP_CALL,
+        &&op_OP_TAILCALL, &&op_OP_RET, &&op_OP_JMP, &&op_OP_IF,
+        &&op_OP_CONST2_ADD, &&op_OP_HEAD_TAIL, &&op_OP_ARITH,
+        &&op_OP_ARITH_LONG, &&op_OP_ARITH_DOUBLE, &&op_OP_ARITH_POLY,
+        &&op_OP_FOLDED};
+#endif
+
+    int base = vm_fcount;
+    code->ref++;
+    vm_push_frame(env, code);
+    vm_depth++;
+
+    lval *e = env;
+    int *ops = code->ops;
+    lval **k = code->consts;
+    int pc = 0;
+    int n, tail;
+
+#ifdef VM_THREADED
+    VM_NEXT();
+#else
+    while (1)
+    {
+        switch (ops[pc++])
+        {
+#endif
+
+    VM_OP(OP_CONST):
+        vm_push(lval_copy(k[ops[pc++]]));
+        VM_NEXT();
+
+    VM_OP(OP_CONST2):
+        vm_push(lval_copy(k[ops[pc++]]));
+        vm_push(lval_copy(k[ops[pc++]]));
+        VM_NEXT();
+
+    VM_OP(OP_LOAD):
+        vm_push(lenv_get(e, k[ops[pc++]]));
+        VM_NEXT();
+
+    VM_OP(OP_JMP):
+        pc = ops[pc];
+        VM_NEXT();
+
+    // a pure call folded when the body was compiled. the value stands while
+    // no builtin has been redefined and no local added since, otherwise run
+    // the code for the call that follows
+    VM_OP(OP_FOLDED):
+        if (ops[pc + 1] == builtins_rebound && ops[pc + 2] == scope_epoch)
+        {
+            vm_push(lval_copy(k[ops[pc]]));
+            pc = ops[pc + 3];
+            VM_NEXT();
+        }
+        pc += 4;
+        VM_NEXT();
+
+    VM_OP(OP_CONST2_ADD):
+    {
+        lval *x = k[ops[pc++]];
+        lval *y = k[ops[pc++]];
+        lval *f = lenv_get(e, k[ops[pc++]]);
+        long r;
+        if (f->type == LVAL_FUN && f->fun == builtin_add &&
+            !long_add_overflow(x->lng, y->lng, &r))
+        {
+            lval_del(f);
+            vm_push(lval_long(r));
+            pc += 2;
+            VM_NEXT();
+        }
+        vm_push(f);
+        vm_push(lval_copy(x));
+        vm_push(lval_copy(y));
+        VM_NEXT();
+    }
+
+    // the first run of an arithmetic site records its operand types and
+    // rewrites the instruction in place
+    VM_OP(OP_ARITH):
+    {
+        n = ops[pc + 2];
+        int type = vm_stack[vm_sp - n]->type;
+        if (!arith_all(&vm_stack[vm_sp - n], n, type))
+        {
+            type = -1;
+        }
+        ops[pc - 1] = type == LVAL_LONG     ? OP_ARITH_LONG
+                      : type == LVAL_DOUBLE ? OP_ARITH_DOUBLE
+                                            : OP_ARITH_POLY;
+        pc--;
+        VM_NEXT();
+    }
+
+    // specialised sites fall back to the generic call when the builtin is
+    // rebound or the result needs it, and stay generic once the operand
+    // types change
+    VM_OP(OP_ARITH_LONG):
+    VM_OP(OP_ARITH_DOUBLE):
+    {
+        int type = ops[pc - 1] == OP_ARITH_LONG ? LVAL_LONG : LVAL_DOUBLE;
+        lval *f = lenv_get(e, k[ops[pc]]);
+        int op = ops[pc + 1];
+        n = ops[pc + 2];
+        lval **xs = &vm_stack[vm_sp - n];
+        pc += 3;
+
+        if (!arith_all(xs, n, type))
+        {
+            ops[pc - 4] = OP_ARITH_POLY;
+        }
+        else if (f->type == LVAL_FUN && f->fun == arith_builtins[op])
+        {
+            lval *r = type == LVAL_LONG ? arith_longs(op, xs, n) : arith_doubles(op, xs, n);
+            if (r)
+            {
+                lval_del(f);
+                for (int i = 0; i < n; i++)
+                {
+                    lval_del(xs[i]);
+                }
+                vm_sp -= n;
+                vm_push(r);
+                pc += 2;
+                VM_NEXT();
+            }
+        }
+        vm_insert(n, f);
+        VM_NEXT();
+    }
+
+    VM_OP(OP_ARITH_POLY):
+        n = ops[pc + 2];
+        vm_insert(n, lenv_get(e, k[ops[pc]]));
+        pc += 3;
+        VM_NEXT();
+
+    VM_OP(OP_HEAD_TAIL):
+    {
+        lval *fh = lenv_get(e, k[ops[pc++]]);
+        lval *ft = lenv_get(e, k[ops[pc++]]);
+        lval *x = vm_stack[vm_sp - 1];
+        if (fh->type == LVAL_FUN && fh->fun == builtin_head &&
+            ft->type == LVAL_FUN && ft->fun == builtin_tail &&
+            lval_is_qexpr(x) && x->count >= 2)
+        {
+            lval_del(fh);
+            lval_del(ft);
+            x = lval_unshare(x);
+            vm_stack[vm_sp - 1] = lval_slice(x, 1, 1);
+            pc += 4;
+            VM_NEXT();
+        }
+        vm_insert(1, ft);
+        vm_insert(2, fh);
+        VM_NEXT();
+    }
+
+    VM_OP(OP_IF):
+    {
+        lval *f = lenv_get(e, k[ops[pc]]);
+        lval *c = vm_stack[vm_sp - 1];
+        if (f->type == LVAL_FUN && f->fun == builtin_if && lval_is_num(c))
+        {
+            lval_del(f);
+            vm_sp--;
+            pc = lval_truth(c) ? pc + 6 : ops[pc + 4];
+            lval_del(c);
+            VM_NEXT();
+        }
+
+        // the general call, continuing after both branches
+        vm_insert(1, f);
+        vm_push(lval_copy(k[ops[pc + 1]]));
+        vm_push(lval_copy(k[ops[pc + 2]]));
+        tail = ops[pc + 3];
+        pc = ops[pc + 5];
+        n = 4;
+        goto call;
+    }
+
+    VM_OP(OP_CALL):
+        n = ops[pc++];
+        tail = 0;
+        goto call;
+
+    VM_OP(OP_TAILCALL):
+        n = ops[pc++];
+        tail = 1;
+        goto call;
+
+    call:
+    {
+        lval **args = &vm_stack[vm_sp - n];
+
+        // the first error among the items wins, as in lval_eval
+        int err = -1;
+        for (int i = 0; i < n && err < 0; i++)
+        {
+            if (args[i]->type == LVAL_ERR)
+            {
+                err = i;
+            }
+        }
+        if (err >= 0)
+        {
+            lval *x = args[err];
+            for (int i = 0; i < n; i++)
+            {
+                if (i != err)
+                {
+                    lval_del(args[i]);
+                }
+            }
+            vm_sp -= n;
+            vm_push(x);
+            VM_NEXT();
+        }
+
+        if (n == 1)
+        {
+            VM_NEXT();
+        }
+
+        lval *f = args[0];
+        if (f->type != LVAL_FUN)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                lval_del(args[i]);
+            }
+            vm_sp -= n;
+            vm_push(lval_err("sexpression does not start with function"));
+            VM_NEXT();
+        }
+
+        lval *a = lval_sexpr();
+        lval_reserve(a, 0, n - 1);
+        for (int i = 1; i < n; i++)
+        {
+            a = lval_add(a, args[i]);
+        }
+        vm_sp -= n;
+
+        if (f->fun && !builtin_is_tail(f->fun))
+        {
+            vm_frames[vm_fcount - 1].pc = pc;
+            lval *r = memo_cap && builtin_is_memo(f->fun) ? memo_call(e, f->fun, a)
+                                                          : f->fun(e, a);
+            lval_del(f);
+            vm_push(r);
+            VM_NEXT();
+        }
+
+        lval *env2;
+        bcode *code2;
+        if (f->fun)
+        {
+            vm_frames[vm_fcount - 1].pc = pc;
+            code2 = code_expr_of(f->fun(e, a));
+            env2 = lval_copy(e);
+        }
+        else
+        {
+            lval *r = jit_enabled ? jit_call(f, a) : NULL;
+            if (r)
+            {
+                lval_del(f);
+                vm_push(r);
+                VM_NEXT();
+            }
+
+            env2 = lval_bind(f, a);
+            if (env2->type == LVAL_ERR)
+            {
+                lval_del(f);
+                vm_push(env2);
+                VM_NEXT();
+            }
+            code2 = f->code;
+            code2->ref++;
+        }
+        lval_del(f);
+
+        vm_frame *fr = &vm_frames[vm_fcount - 1];
+        if (tail)
+        {
+            lval_del(fr->env);
+            code_release(fr->code, 0);
+            fr->env = env2;
+            fr->code = code2;
+            fr->pc = 0;
+        }
+        else
+        {
+            fr->pc = pc;
+            vm_push_frame(env2, code2);
+        }
+
+        e = env2;
+        ops = code2->ops;
+        k = code2->consts;
+        pc = 0;
+        vm_safepoint();
+        VM_NEXT();
+    }
+
+    VM_OP(OP_RET):
+    {
+        lval *r = vm_stack[--vm_sp];
+        vm_frame *fr = &vm_frames[--vm_fcount];
+        lval_del(fr->env);
+        code_release(fr->code, 0);
+
+        if (vm_fcount == base)
+        {
+            vm_depth--;
+            return r;
+        }
+
+        vm_push(r);
+        fr = &vm_frames[vm_fcount - 1];
+        e = fr->env;
+        ops = fr->code->ops;
+        k = fr->code->consts;
+        pc = fr->pc;
+        VM_NEXT();
+    }
+
+#ifndef VM_THREADED
+        }
+    }
+#endif
+}
+
+#undef VM_OP
+#undef VM_NEXT
+
+// evaluate x in e without recursing on the C stack. an S-expression pushes
+// a continuation holding its frame and the index of the child being
+// evaluated; once every child has a value it is popped and applied. eval
+// and if replace the expression in hand instead of returning to a
+// continuation, and lambdas run compiled in vm_run, so tail calls run in
+// constant space.
+lval *lval_eval(lval *e, lval *x)
+{
+    int base = eval_count;
+    lval *val;
+    e = lval_copy(e);
+    eval_depth++;
+
+    while (1)
+    {
+        eval_safepoint(e, x);
+
+        if (x->type == LVAL_SYM)
+        {
+            val = lenv_get(e, x);
+            lval_del(x);
+        }
+        else if (x->type == LVAL_SEXPR && x->count > 0)
+        {
+            x = lval_unshare(x);
+            lval_own(x);
+            eval_push(e, x);
+            lval *c = x->cell[0];
+            x->cell[0] = NULL;
+            x = c;
+            continue;
+        }
+        else
+        {
+            val = x;
+        }
+
+        // hand val to the waiting continuations until one needs more work
+        while (1)
+        {
+            if (eval_count == base)
+            {
+                lval_del(e);
+                eval_depth--;
+                return val;
+            }
+
+            cont *k = &eval_stack[eval_count - 1];
+            lval *v = k->expr;
+            v->cell[k->i++] = val;
+            if (k->i < v->count)
+            {
+                x = v->cell[k->i];
+                v->cell[k->i] = NULL;
+                if (k->env != e)
+                {
+                    lval_del(e);
+                    e = lval_copy(k->env);
+                }
+                break;
+            }
+
+            // every child has a value, apply
+            lval_del(e);
+            e = k->env;
+            eval_count--;
+
+            int err = -1;
+            for (int i = 0; i < v->count && err < 0; i++)
+            {
+                if (v->cell[i]->type == LVAL_ERR)
+                {
+                    err = i;
+                }
+            }
+            if (err >= 0)
+            {
+                val = lval_take(v, err);
+                continue;
+            }
+
+            if (v->count == 1)
+            {
+                val = lval_take(v, 0);
+                continue;
+            }
+
+            lval *f = lval_pop(v, 0);
+            if (f->type != LVAL_FUN)
+            {
+                lval_del(f);
+                lval_del(v);
+                val = lval_err("sexpression does not start with function");
+                continue;
+            }
+
+            if (f->fun && !builtin_is_tail(f->fun))
+            {
+                val = memo_cap && builtin_is_memo(f->fun) ? memo_call(e, f->fun, v)
+                                                          : f->fun(e, v);
+                lval_del(f);
+                continue;
+            }
+
+            if (f->fun)
+            {
+                x = f->fun(e, v);
+                lval_del(f);
+                break;
+            }
+
+            // lambdas run compiled, the VM keeps its own frames from here
+            if (jit_enabled && (val = jit_call(f, v)))
+            {
+                lval_del(f);
+                continue;
+            }
+            lval *frame = lval_bind(f, v);
+            if (frame->type == LVAL_ERR)
+            {
+                lval_del(f);
+                val = frame;
+                continue;
+            }
+            bcode *code = f->code;
+            code->ref++;
+            lval_del(f);
+
+            gc_root(e);
+            val = vm_run(frame, code);
+            gc_unroot(e);
+            code_release(code, 0);
+        }
+    }
+}
+
+// share read data through the hash-consing table. every value inside a
+// qexpr is data, elsewhere only numbers are. returns the canonical node,
+// consuming v.
+lval *lval_hashcons(lval *v, int data)
+{
+    switch (v->type)
+    {
+    case LVAL_LONG:
+    case LVAL_DOUBLE:
+    case LVAL_BIGNUM:
+    case LVAL_VECTOR:
+        break;
+    case LVAL_SYM:
+        if (!data)
+        {
+            return v;
+        }
+        break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    {
+        // lambda bodies keep private symbols for their own scope
+        if (lval_is_lambda(v))
+        {
+            return v;
+        }
+
+        int canonical = 1;
+        lval_own(v);
+        for (int i = 0; i < v->count; i++)
+        {
+            v->cell[i] = lval_hashcons(v->cell[i], data || v->type == LVAL_QEXPR);
+            canonical = canonical && v->cell[i]->consed;
+        }
+        if (!canonical || !(data || v->type == LVAL_QEXPR))
+        {
+            return v;
+        }
+        break;
+    }
+    default:
+        return v;
+    }
 
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    return x;
+    lval *c = hc_intern(v);
+    if (c != v)
+    {
+        lval_copy(c);
+        lval_del(v);
+    }
+    return c;
 }
 
-lval *lval_take(lval *v, int i)
+// runtime used by programs from --emit-c. each top level form becomes
+// straight-line C pushing its items on the VM stack and calling, so the
+// program never parses and no tree walk runs. rt_call hands the call to
+// vm_run, which treats the pushed items like those of its own CALL.
+lval *rt_keep(lval *v)
 {
-    lval *x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+    gc_root(v);
+    return v;
 }
 
-#define LASSERT(args, cond, err) \
-    if (!(cond))                 \
-    {                            \
-        lval_del(args);          \
-        return lval_err(err);    \
-    }
-
-lval *builtin_head(lval *a)
+lval *rt_list(int qexpr, int n, ...)
 {
-    LASSERT(a, a->count == 1,
-            "head passed more than one qexpr");
-
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "head passed non-qexpr");
-
-    LASSERT(a, a->cell[0]->count != 0,
-            "head on empty qexpr");
-
-    // take qexpr
-    lval *v = lval_take(a, 0);
-
-    // delete everything but the head
-    while (v->count > 1)
+    lval *v = qexpr ? lval_qexpr() : lval_sexpr();
+    va_list ap;
+    va_start(ap, n);
+    for (int i = 0; i < n; i++)
     {
-        lval_del(lval_pop(v, 1));
+        v = lval_add(v, va_arg(ap, lval *));
     }
-    return v;
+    va_end(ap);
+    return qexpr ? lval_pack(v) : v;
 }
 
-lval *builtin_tail(lval *a)
+void rt_const(lval *v)
 {
-    LASSERT(a, a->count == 1,
-            "tail passed more than one qexpr");
-
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "tail passed non-qexpr");
-
-    LASSERT(a, a->cell[0]->count != 0,
-            "tail on empty qexpr");
-
-    // take qexpr
-    lval *v = lval_take(a, 0);
-
-    // delete head
-    lval_del(lval_pop(v, 0));
-    return v;
+    vm_push(lval_copy(v));
 }
 
-lval *builtin_list(lval *a)
+void rt_load(lval *k)
 {
-    a->type = LVAL_QEXPR;
-    return a;
+    vm_push(lenv_get(global_env, k));
 }
 
-lval *lval_eval(lval *v);
-
-lval *builtin_eval(lval *a)
+void rt_call(int n)
 {
-    LASSERT(a, a->count == 1,
-            "eval passed more than one qexpr");
+    static bcode **calls = NULL;
+    static int ncalls = 0;
+    if (n >= ncalls)
+    {
+        calls = realloc(calls, sizeof(bcode *) * (n + 1));
+        memset(&calls[ncalls], 0, sizeof(bcode *) * (n + 1 - ncalls));
+        ncalls = n + 1;
+    }
+    if (calls[n] == NULL)
+    {
+        calls[n] = code_new();
+        code_call(calls[n], n, 0);
+        code_op(calls[n], OP_RET);
+    }
 
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "eval passed non-qexpr");
+    eval_depth++;
+    vm_push(vm_run(lval_copy(global_env), calls[n]));
+    eval_depth--;
+}
 
-    lval *x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(x);
+void rt_print(void)
+{
+    lval *x = vm_stack[--vm_sp];
+    lval_println(x);
+    lval_del(x);
+    gc_safepoint();
 }
 
-lval *lval_join(lval *x, lval *y)
+// C source for a constant
+void emit_value(FILE *out, lval *v)
 {
-    while (y->count)
+    switch (v->type)
+    {
+    case LVAL_LONG:
+        if (v->lng == LONG_MIN)
+        {
+            fprintf(out, "lval_long(-%ldL - 1)", LONG_MAX);
+        }
+        else
+        {
+            fprintf(out, "lval_long(%ldL)", v->lng);
+        }
+        return;
+    case LVAL_DOUBLE:
+        if (v->dbl != v->dbl || v->dbl - v->dbl != 0)
+        {
+            fprintf(out, "lval_double(strtod(\"%f\", NULL))", v->dbl);
+        }
+        else
+        {
+            fprintf(out, "lval_double(%a)", v->dbl);
+        }
+        return;
+    case LVAL_BIGNUM:
     {
-        x = lval_add(x, lval_pop(y, 0));
+        char *s = big_to_str(v->big);
+        fprintf(out, "lval_bignum(big_from_str(\"%s\"))", s);
+        free(s);
+        return;
+    }
+    case LVAL_SYM:
+        fputs("lval_sym(\"", out);
+        for (char *c = v->sym; *c; c++)
+        {
+            if (*c == '\\' || *c == '"')
+            {
+                fputc('\\', out);
+            }
+            fputc(*c, out);
+        }
+        fputs("\")", out);
+        return;
     }
 
-    lval_del(y);
-    return x;
+    fprintf(out, "rt_list(%d, %d", v->type != LVAL_SEXPR, v->count);
+    for (int i = 0; i < v->count; i++)
+    {
+        lval *x = lval_item(v, i);
+        fputs(", ", out);
+        emit_value(out, x);
+        lval_del(x);
+    }
+    fputs(")", out);
 }
 
-lval *builtin_join(lval *a)
+int emit_const(lval ***ks, int *nks, lval *v)
 {
-    for (int i = 0; i < a->count; i++)
+    *ks = realloc(*ks, sizeof(lval *) * (*nks + 1));
+    (*ks)[*nks] = v;
+    return (*nks)++;
+}
+
+void emit_expr(FILE *out, lval ***ks, int *nks, lval *v)
+{
+    if (v->type == LVAL_SYM)
     {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-                "join passed non-qexpr");
+        fprintf(out, "    rt_load(K[%d]);\n", emit_const(ks, nks, v));
     }
-
-    lval *x = lval_pop(a, 0);
-    while (a->count)
+    else if (v->type == LVAL_SEXPR && v->count > 0)
     {
-        x = lval_join(x, lval_pop(a, 0));
+        for (int i = 0; i < v->count; i++)
+        {
+            emit_expr(out, ks, nks, v->cell[i]);
+        }
+        fprintf(out, "    rt_call(%d);\n", v->count);
+    }
+    else
+    {
+        fprintf(out, "    rt_const(K[%d]);\n", emit_const(ks, nks, v));
     }
-
-    lval_del(a);
-    return x;
 }
 
-lval *builtin_len(lval *a)
+// write a C program evaluating forms and printing each result
+void emit_c(FILE *out, lval **forms, int n)
 {
-    LASSERT(a, a->count == 1,
-            "len passed more than one qexpr");
-
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "len passed non-qexpr");
+    lval **ks = NULL;
+    int nks = 0;
 
-    lval *v = lval_pop(a, 0);
-    lval *len = lval_long(v->count);
+    fputs("// generated by clisp --emit-c, build against the runtime with\n"
+          "// cc -std=c99 -DCLISP_NO_MAIN -c parsing.c mpc.c\n"
+          "// cc -std=c99 program.c parsing.o mpc.o -lm\n"
+          "#include <stdlib.h>\n\n"
+          "typedef struct lval lval;\n"
+          "typedef struct bignum bignum;\n"
+          "lval *lval_long(long x);\n"
+          "lval *lval_double(double x);\n"
+          "lval *lval_bignum(bignum *b);\n"
+          "bignum *big_from_str(const char *s);\n"
+          "lval *lval_sym(char *s);\n"
+          "lval *rt_keep(lval *v);\n"
+          "lval *rt_list(int qexpr, int n, ...);\n"
+          "void rt_const(lval *v);\n"
+          "void rt_load(lval *k);\n"
+          "void rt_call(int n);\n"
+          "void rt_print(void);\n"
+          "void clisp_init(int argc, char **argv);\n"
+          "void clisp_finish(void);\n\n"
+          "static lval **K;\n",
+          out);
 
-    lval_del(v);
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(out, "\nstatic void form_%d(void)\n{\n", i);
+        emit_expr(out, &ks, &nks, forms[i]);
+        fputs("    rt_print();\n}\n", out);
+    }
 
-    return len;
+    fprintf(out, "\nstatic void load(void)\n{\n    K = malloc(sizeof(lval *) * %d);\n", nks ? nks : 1);
+    for (int i = 0; i < nks; i++)
+    {
+        fprintf(out, "    K[%d] = rt_keep(", i);
+        emit_value(out, ks[i]);
+        fputs(");\n", out);
+    }
+    fputs("}\n\nint main(int argc, char **argv)\n{\n    clisp_init(argc, argv);\n    load();\n", out);
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(out, "    form_%d();\n", i);
+    }
+    fputs("    clisp_finish();\n    return 0;\n}\n", out);
+    free(ks);
 }
 
-lval *builtin_cons(lval *a)
+void clisp_init(int argc, char **argv)
 {
-    LASSERT(a, a->cell[1]->type == LVAL_QEXPR,
-            "cons passed non-qexpr on right");
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--hash-cons") == 0)
+        {
+            hashcons_enabled = 1;
+        }
+        if (strcmp(argv[i], "--jit") == 0)
+        {
+            jit_enabled = 1;
+        }
+        if (strcmp(argv[i], "--memo") == 0)
+        {
+            memo_cap = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+            memo_cap = memo_cap > 0 ? memo_cap : 4096;
+        }
+    }
 
-    LASSERT(a, a->count == 2,
-            "cons passed too many args");
+    lenv_init();
+}
 
-    lval *x = lval_pop(a, 0);
-    lval *xs = lval_pop(a, 0);
-    lval *cons = lval_qexpr();
+void clisp_finish(void)
+{
+    if (memo_cap)
+    {
+        memo_stats();
+    }
+}
 
-    cons = lval_add(cons, lval_eval(x));
-    cons = lval_join(cons, xs);
-    lval_del(x);
-    lval_del(xs);
+#ifndef CLISP_NO_MAIN
+#ifdef CLISP_PARSER
+// parser written by --emit-parser, e.g. -DCLISP_PARSER='"clisp_parser.c"'
+#include CLISP_PARSER
+#endif
+#ifdef CLISP_GRAMMAR
+// grammar written by --emit-grammar, e.g. -DCLISP_GRAMMAR='"clisp_grammar.h"'
+#include CLISP_GRAMMAR
+#endif
 
-    return cons;
+// parse a line with the generated parser when built with one
+int clisp_parse(mpc_parser_t *Clisp, const char *input, mpc_result_t *r)
+{
+#ifdef CLISP_PARSER
+    (void)Clisp;
+    return clisp_grammar_parse("<stdin>", input, r);
+#else
+    return mpc_parse("<stdin>", input, Clisp, r);
+#endif
 }
 
-lval *builtin_init(lval *a)
+// a line of f without its newline, NULL at end of input
+char *read_line(FILE *f)
 {
-    LASSERT(a, a->count == 1,
-            "init passed more than one qexpr");
+    int cap = 256;
+    int n = 0;
+    char *s = malloc(cap);
+    int c;
+    while ((c = fgetc(f)) != EOF && c != '\n')
+    {
+        if (n + 1 == cap)
+        {
+            cap *= 2;
+            s = realloc(s, cap);
+        }
+        s[n++] = c;
+    }
+    if (c == EOF && n == 0)
+    {
+        free(s);
+        return NULL;
+    }
+    s[n] = '\0';
+    return s;
+}
 
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-            "init passed non-qexpr");
+// push parser for input that arrives in chunks. a form that starts with a
+// bracket is parsed and passed to emit as soon as its brackets close, and
+// one that starts with an atom runs up to the end of its line, so unlike
+// the repl "(f 1) 2" reads as two forms here, write "f 1 2" instead. forms may span several lines
+// and chunks, and each byte is scanned once however it is split up. a form
+// longer than STREAM_MAX_FORM is dropped with an error so one stray open
+// bracket cannot buffer the rest of the input.
+#define STREAM_MAX_FORM (1 << 20)
 
-    LASSERT(a, a->cell[0]->count != 0,
-            "init on empty qexpr");
+typedef struct stream
+{
+    mpc_parser_t *parser;
+    void (*emit)(mpc_result_t *r, int ok, void *data);
+    void *data;
+    char *buf;
+    int len;
+    int cap;
+    int start;
+    int scan;
+    int depth;
+    char lead;
+} stream;
 
-    lval *v = lval_pop(a, 0);
+void stream_init(stream *s, mpc_parser_t *parser,
+                 void (*emit)(mpc_result_t *r, int ok, void *data), void *data)
+{
+    s->parser = parser;
+    s->emit = emit;
+    s->data = data;
+    s->cap = 256;
+    s->buf = malloc(s->cap);
+    s->len = 0;
+    s->start = 0;
+    s->scan = 0;
+    s->depth = 0;
+    s->lead = 0;
+}
 
-    // delete last item
-    lval_del(lval_pop(v, v->count - 1));
+// parse buf[start, end) as one form unless it is only whitespace, then
+// start the next form at end
+int stream_emit(stream *s, int end)
+{
+    int i = s->start;
+    while (i < end && strchr(" \t\r\f\v\n", s->buf[i]))
+    {
+        i++;
+    }
+    int start = s->start;
+    s->start = end;
+    s->lead = 0;
+    if (i == end)
+    {
+        return 0;
+    }
 
-    return v;
+    // the byte after the form may already be buffered, keep it
+    mpc_result_t r;
+    char next = s->buf[end];
+    s->buf[end] = '\0';
+    int ok = clisp_parse(s->parser, s->buf + start, &r);
+    s->buf[end] = next;
+    s->emit(&r, ok, s->data);
+    return 1;
 }
 
-lval *builtin_op(lval *a, char *op)
+// drop the form being read and report it as a parse error
+void stream_overflow(stream *s)
 {
-    // ensure args are nums
-    for (int i = 0; i < a->count; i++)
+    mpc_result_t r;
+    mpc_parser_t *fail = mpc_failf("form longer than %d bytes", STREAM_MAX_FORM);
+    mpc_parse("<stream>", "", fail, &r);
+    mpc_delete(fail);
+    s->emit(&r, 0, s->data);
+    s->start = s->scan + 1;
+    s->depth = 0;
+    s->lead = 0;
+}
+
+// returns the number of forms passed to emit
+int stream_feed(stream *s, const char *chunk, int n)
+{
+    int forms = 0;
+
+    if (s->start > 0)
     {
-        int type = a->cell[i]->type;
-        if (type != LVAL_DOUBLE && type != LVAL_LONG)
+        memmove(s->buf, s->buf + s->start, s->len - s->start);
+        s->len -= s->start;
+        s->scan -= s->start;
+        s->start = 0;
+    }
+    if (s->len + n + 1 > s->cap)
+    {
+        while (s->len + n + 1 > s->cap)
         {
-            lval_del(a);
-            return lval_err("cannot operate on non numbers");
+            s->cap *= 2;
         }
+        s->buf = realloc(s->buf, s->cap);
     }
+    memcpy(s->buf + s->len, chunk, n);
+    s->len += n;
 
-    // pop first thing
-    lval *x = lval_pop(a, 0);
-
-    // unary negation
-    if ((strcmp(op, "-") == 0) && a->count == 0)
+    for (; s->scan < s->len; s->scan++)
     {
-        if (x->type == LVAL_DOUBLE)
+        char c = s->buf[s->scan];
+        if (!s->lead && !strchr(" \t\r\f\v\n", c))
         {
-            x->dbl = -x->dbl;
+            s->lead = c;
         }
-        else
+
+        if (c == '(' || c == '{')
         {
-            x->lng = -x->lng;
+            s->depth++;
         }
-    }
-
-    while (a->count > 0)
-    {
-        lval *y = lval_pop(a, 0);
-        if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE)
+        else if ((c == ')' || c == '}') && s->depth > 0)
         {
-            double a = x->type == LVAL_LONG ? (double)x->lng : x->dbl;
-            double b = y->type == LVAL_LONG ? (double)y->lng : y->dbl;
-            x = eval_doubles(a, op, b);
+            s->depth--;
+            if (s->depth == 0 && (s->lead == '(' || s->lead == '{'))
+            {
+                forms += stream_emit(s, s->scan + 1);
+                continue;
+            }
         }
-        else
+        else if (c == '\n' && s->depth == 0)
         {
-            x = eval_longs(x->lng, op, y->lng);
+            forms += stream_emit(s, s->scan + 1);
+            continue;
         }
 
-        lval_del(y);
+        if (s->scan + 1 - s->start > STREAM_MAX_FORM)
+        {
+            stream_overflow(s);
+        }
     }
-
-    lval_del(a);
-    return x;
+    return forms;
 }
 
-lval *builtin(lval *a, char *func)
+// passes on whatever is left as the last form and frees the buffer
+int stream_finish(stream *s)
 {
-    if (strcmp("list", func) == 0)
-    {
-        return builtin_list(a);
-    }
-    if (strcmp("head", func) == 0)
-    {
-        return builtin_head(a);
-    }
-    if (strcmp("tail", func) == 0)
-    {
-        return builtin_tail(a);
-    }
-    if (strcmp("join", func) == 0)
-    {
-        return builtin_join(a);
-    }
-    if (strcmp("eval", func) == 0)
-    {
-        return builtin_eval(a);
-    }
-    if (strcmp("cons", func) == 0)
-    {
-        return builtin_cons(a);
-    }
-    if (strcmp("init", func) == 0)
-    {
-        return builtin_init(a);
-    }
-    if (strcmp("len", func) == 0)
-    {
-        return builtin_len(a);
-    }
-    if (strstr("+-*/%^minmax", func))
-    {
-        return builtin_op(a, func);
-    }
-    lval_del(a);
-    return lval_err("unknown function");
+    int forms = stream_emit(s, s->len);
+    free(s->buf);
+    s->buf = NULL;
+    s->len = s->cap = s->start = s->scan = s->depth = 0;
+    s->lead = 0;
+    return forms;
 }
 
-lval *lval_eval_sexpr(lval *v)
+// --emit-c: read a whole program from stdin and write it out as C
+int emit_program(mpc_parser_t *Clisp)
 {
-    // evaluate children
-    for (int i = 0; i < v->count; i++)
+    lval **forms = NULL;
+    int n = 0;
+    char *input;
+    while ((input = read_line(stdin)))
     {
-        v->cell[i] = lval_eval(v->cell[i]);
-    }
+        mpc_result_t r;
+        if (!clisp_parse(Clisp, input, &r))
+        {
+            mpc_err_print_to(r.error, stderr);
+            mpc_err_delete(r.error);
+            free(input);
+            return 1;
+        }
 
-    // check for errors
-    for (int i = 0; i < v->count; i++)
-    {
-        if (v->cell[i]->type == LVAL_ERR)
-            return lval_take(v, i);
+        lval *parsed = lval_read(r.output);
+        lval_resolve(global_scope, parsed);
+        forms = realloc(forms, sizeof(lval *) * (n + 1));
+        forms[n++] = parsed;
+        mpc_ast_delete(r.output);
+        free(input);
     }
 
-    // empty expression
-    if (v->count == 0)
+    emit_c(stdout, forms, n);
+    for (int i = 0; i < n; i++)
     {
-        return v;
+        lval_del(forms[i]);
     }
+    free(forms);
+    return 0;
+}
 
-    // single expression
-    if (v->count == 1)
+// --emit-grammar: write the built grammar out as a C array
+int emit_grammar(mpc_parser_t *Double, mpc_parser_t *Long, mpc_parser_t *Symbol,
+                 mpc_parser_t *Sexpr, mpc_parser_t *Qexpr, mpc_parser_t *Expr,
+                 mpc_parser_t *Clisp)
+{
+    unsigned char *data;
+    size_t len;
+    mpc_err_t *err = mpc_serialise(&data, &len, 7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+    if (err)
     {
-        return lval_take(v, 0);
+        mpc_err_print_to(err, stderr);
+        mpc_err_delete(err);
+        return 1;
     }
 
-    // ensure first is symbol
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_SYM)
+    printf("/* Generated by clisp --emit-grammar, do not edit */\n");
+    printf("static const unsigned char clisp_grammar_data[%lu] = {", (unsigned long)len);
+    for (size_t i = 0; i < len; i++)
     {
-        lval_del(f);
-        lval_del(v);
-        return lval_err("sexpression does not start with symbol");
+        printf("%s0x%02x", i % 12 ? ", " : (i ? ",\n    " : "\n    "), data[i]);
     }
-
-    lval *result = builtin(v, f->sym);
-    lval_del(f);
-    return result;
+    printf("\n};\n");
+    free(data);
+    return 0;
 }
 
-lval *lval_eval(lval *v)
+// evaluate and print one parsed form, or print why it did not parse
+void run_form(mpc_result_t *r, int ok, void *data)
 {
-    if (v->type == LVAL_SEXPR)
+    (void)data;
+    if (ok)
     {
-        return lval_eval_sexpr(v);
+        lval *parsed = lval_read(r->output);
+        lval_println(parsed);
+        lval_resolve(global_scope, parsed);
+        if (hashcons_enabled)
+        {
+            parsed = lval_hashcons(parsed, 0);
+        }
+        lval *x = lval_eval(global_env, parsed);
+        lval_println(x);
+        lval_del(x);
+        mpc_ast_delete(r->output);
+        gc_safepoint();
     }
-    return v;
+    else
+    {
+        mpc_err_print(r->error);
+        mpc_err_delete(r->error);
+    }
+    // the next form may be a while coming, show this result now
+    fflush(stdout);
 }
 
 int main(int argc, char **argv)
@@ -657,18 +5519,91 @@ int main(int argc, char **argv)
     mpc_parser_t *Expr = mpc_new("expr");
     mpc_parser_t *Clisp = mpc_new("clisp");
 
+#ifdef CLISP_GRAMMAR
+    mpc_err_t *err = mpc_deserialise(clisp_grammar_data, sizeof(clisp_grammar_data), 7,
+                                     Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+    if (err)
+    {
+        mpc_err_print_to(err, stderr);
+        mpc_err_delete(err);
+        mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+        return 1;
+    }
+#else
     mpca_lang(MPCA_LANG_DEFAULT, "                                       \
         double  : /-?[0-9]+\\.[0-9]+/ ;                                  \
         long    : /-?[0-9]+/ ;                                           \
-        symbol  : '+' | '-' | '*' | '/' | '%' | '^' | \"min\"| \"max\"   \
-                | \"list\" | \"head\" | \"tail\" | \"join\" | \"eval\"   \
-                | \"cons\" | \"init\" | \"len\" ;                        \
+        symbol  : /[a-zA-Z_][a-zA-Z0-9_]*/ | '+' | '-' | '*' | '/'       \
+                | '%' | '^' | '\\\\' | \"==\" | \"!=\" | \"<=\" | \">=\" \
+                | '<' | '>' | '=' | '&' ;                                \
         sexpr   : '(' <expr>* ')' ;                                      \
         qexpr   : '{' <expr>* '}' ;                                      \
         expr    : <double> | <long> | <symbol> | <sexpr> | <qexpr> ;     \
         clisp   : /^/ <expr>+ /$/ ;                                      \
     ",
               Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+#endif
+
+    mpc_analyse(Clisp, NULL);
+
+    clisp_init(argc, argv);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--emit-c") == 0)
+        {
+            int status = emit_program(Clisp);
+            mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+            return status;
+        }
+        if (strcmp(argv[i], "--emit-grammar") == 0)
+        {
+            int status = emit_grammar(Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+            mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+            return status;
+        }
+        if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream s;
+            char chunk[4096];
+            stream_init(&s, Clisp, run_form, NULL);
+            int n = 0;
+            int c;
+            // hand over each line, and each closing bracket, as it is read
+            // so a form that closes mid line does not wait for the newline
+            while ((c = getchar()) != EOF)
+            {
+                chunk[n++] = c;
+                if (c == '\n' || c == ')' || c == '}' || n == sizeof chunk)
+                {
+                    stream_feed(&s, chunk, n);
+                    n = 0;
+                }
+            }
+            stream_feed(&s, chunk, n);
+            stream_finish(&s);
+            clisp_finish();
+            mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+            return 0;
+        }
+        if (strcmp(argv[i], "--grammar-report") == 0)
+        {
+            printf("%i rules need backtracking\n", mpc_analyse(Clisp, stdout));
+            mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+            return 0;
+        }
+        if (strcmp(argv[i], "--emit-parser") == 0)
+        {
+            mpc_err_t *err = mpc_codegen(stdout, "clisp_grammar", Clisp);
+            if (err)
+            {
+                mpc_err_print_to(err, stderr);
+                mpc_err_delete(err);
+            }
+            mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
+            return err != NULL;
+        }
+    }
 
     puts("clisp v 0.2");
     puts("press ctrl+c to exit\n");
@@ -676,25 +5611,20 @@ int main(int argc, char **argv)
     while (1)
     {
         char *input = readline("clisp> ");
-
-        mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Clisp, &r))
-        {
-            lval *parsed = lval_read(r.output);
-            lval_println(parsed);
-            lval *x = lval_eval(parsed);
-            lval_println(x);
-            lval_del(x);
-            lval_del(parsed);
-            mpc_ast_delete(r.output);
-        }
-        else
+        if (input == NULL)
         {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            break;
         }
+
+        mpc_result_t r;
+        int ok = clisp_parse(Clisp, input, &r);
+        run_form(&r, ok, NULL);
+        free(input);
     }
 
+    clisp_finish();
+
     mpc_cleanup(7, Double, Long, Symbol, Sexpr, Qexpr, Expr, Clisp);
     return 0;
 }
+#endif